@@ -0,0 +1,4695 @@
+// PGM image processing library, see pgm.h for the API.
+// Nothing in here prints; failures come back as PgmStatus codes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <malloc.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "pgm.h"
+
+// Constants for Canny
+#define CANNY_BLUR_SUM 159            // sum of the 5x5 Gaussian weights
+#define CANNY_TAN_22_5 0.41421356f    // sector limits of the gradient direction
+#define CANNY_TAN_67_5 2.41421356f
+#define CANNY_TAN_22_5_Q16 27146      // same in 16.16 fixed point
+#define CANNY_TAN_67_5_Q16 158218
+#define LOW_THRESHOLD_RATIO 0.09
+#define HIGH_THRESHOLD_RATIO 0.18
+
+// Pixel rows start on cache line boundaries
+#define PGM_ALIGNMENT 64
+
+// guard band of the results operators allocate for a source with a border mode: wide enough
+// for the 3x3 stencils, Canny and kernels up to 31x31, larger windows pad a copy
+#define PGM_GUARD_BAND 16
+
+// longest header (with comments) accepted in front of a stream frame
+#define PGM_MAX_HEADER 4096
+
+// Upper bound for worker threads in the parallel stages
+#define MAX_WORKER_THREADS PGM_MAX_THREADS
+
+// Internal Prototypes
+
+// Image buffers
+int alloc_image_buffer(PGMImage* img, int w, int h, int zero);
+int alloc_padded_buffer(PGMImage* img, int w, int h, int pad, int zero);
+void free_image_memory(PGMImage* img);
+
+// Border modes (see the Border Modes section): the operators with a window describe
+// their call as a FramedOp; run_bordered() runs it on the image, or with a border mode
+// on the image extended by its guard band
+typedef enum {
+    FRAMED_CONVOLVE,        // kernel[0]
+    FRAMED_GRADIENT,        // kernel[0], kernel[1]
+    FRAMED_MEAN,            // n = radius
+    FRAMED_MEDIAN,          // n = radius
+    FRAMED_LBP,             // n = mapping
+    FRAMED_CANNY_SUPPRESS,  // n = fixed_point
+    FRAMED_CANNY,           // n = fixed_point
+    FRAMED_MORPHOLOGY       // n = PgmMorphOp, size
+} FramedOpKind;
+
+typedef struct {
+    FramedOpKind kind;
+    int n;
+    const PgmKernel* kernel[2];
+    uint64_t* hist;  // Canny suppression: histogram of the result (NULL if not needed)
+    int hist_inset;  // leaving out this many rows and columns along the edges
+    int size[2];     // morphology: width and height of the rectangle
+    const PgmCannyThresholds* thresholds;  // Canny: NULL for the default ratios
+} FramedOp;
+
+static PgmStatus run_bordered(const PGMImage* src, PGMImage* dst, const FramedOp* op);
+
+// Stage profiling: every heap allocation goes through pgm_malloc and friends;
+// with profiling off they cost a single flag test.
+void* pgm_malloc(size_t n);
+void* pgm_calloc(size_t count, size_t n);
+void* pgm_realloc(void* p, size_t n);
+void* pgm_aligned_alloc(size_t align, size_t n);
+void pgm_free(void* p);
+static void profile_add_fused(const char* names[], const double thread_seconds[], int count);
+
+// Buffer pool: image blocks and per-call scratch are returned here instead of being
+// freed, so a chain of operations ping-pongs between the same few blocks and a long
+// pipeline stops allocating once it has seen every buffer size it needs.
+// Blocks are 64-byte aligned; buffer_pool_put() only takes pointers from this pool.
+void* buffer_pool_get(size_t n, int zero);
+void* buffer_pool_grow(void* p, size_t n);
+void buffer_pool_put(void* p);
+void buffer_pool_clear(void);
+
+// blocks kept for reuse, a block serves requests down to half its size
+#define BUFFER_POOL_SLOTS (4 * MAX_WORKER_THREADS)
+
+// most stage records kept per run
+#define MAX_PROFILE_RECORDS 4096
+#define MAX_PROFILE_DEPTH 16
+
+// Worker pool: row ranges split into fixed chunks, run on all threads
+typedef void (*RowRangeFn)(void* ctx, int y0, int y1);
+int worker_thread_count(void);
+void set_worker_threads(int n);
+int parallel_grain(int width, int min_rows);
+void parallel_rows(int y0, int y1, int grain, RowRangeFn fn, void* ctx);
+
+// resampling weights are fixed point with this many fraction bits; the horizontal
+// pass keeps RESAMPLE_MID_BITS of them so the vertical sums fit 32 bits
+#define RESAMPLE_SHIFT 16
+#define RESAMPLE_MID_BITS 8
+#define RESAMPLE_OUT_SHIFT (RESAMPLE_SHIFT + RESAMPLE_MID_BITS)
+
+// Filtering
+void sort_nine(unsigned char arr[9]);
+
+// Canny helper prototypes
+void canny_blur_row(const PGMImage* img, int y, int* out);
+void canny_gradient_row(const float* b0, const float* b1, const float* b2, int W,
+                        float* mag, unsigned char* sector);
+void canny_gradient_row_fixed(const int* b0, const int* b1, const int* b2, int W,
+                              int64_t* mag2, unsigned char* sector);
+void canny_nms_row(const float* m0, const float* m1, const float* m2, const unsigned char* sector,
+                   int W, unsigned char* out);
+void canny_nms_row_fixed(const int64_t* m0, const int64_t* m1, const int64_t* m2,
+                         const unsigned char* sector, int W, unsigned char* out);
+int hysteresis_thresholding(unsigned char** suppressed, int W, int H, unsigned char** final_edges,
+                            const uint64_t hist[256], const PgmCannyThresholds* thresholds);
+
+// LBP
+const unsigned char* lbp_mapping_table(LbpMapping mapping);
+
+// 3x3 stencil row kernels: out[j] for j0 <= j < j1 from the rows above, at and below
+// *_row_scalar are the reference versions, the SIMD versions must match them bit for bit
+typedef void (*StencilRowFn)(const unsigned char* const rows[3], unsigned char* out, int j0, int j1);
+
+// vertical resampling pass: out[x] for j0 <= x < j1 blended from `taps` rows of Q8 sums
+typedef void (*ResampleRowFn)(const uint32_t* const* rows, const uint32_t* weights, int taps,
+                              unsigned char* out, int j0, int j1);
+
+// convolution passes (see the Convolution section): [float, int][generic, 3, 5, 7 taps]
+typedef void (*ConvRowFn)(const unsigned char* s, const void* taps, int n, int sym, void* out,
+                          int x0, int x1, int add);
+typedef void (*ConvColFn)(const void* const* rows, const void* taps, int n, int sym, void* out, int x0, int x1);
+typedef void (*ConvQuadFn)(const unsigned char* const* rows, const void* taps, int n, void* out, int x0, int x1);
+
+typedef struct {
+    ConvRowFn row[2][4];
+    ConvColFn col[2][4];
+    ConvQuadFn quad[2][4];
+} ConvKernelSet;
+
+typedef struct {
+    const char* name;
+    StencilRowFn average;
+    StencilRowFn sobel;
+    StencilRowFn prewitt;
+    StencilRowFn lbp;
+    StencilRowFn median;
+    ResampleRowFn resample;
+    const ConvKernelSet* conv;
+} StencilKernels;
+
+void average_row_scalar(const unsigned char* const rows[3], unsigned char* out, int j0, int j1);
+void sobel_row_scalar(const unsigned char* const rows[3], unsigned char* out, int j0, int j1);
+void prewitt_row_scalar(const unsigned char* const rows[3], unsigned char* out, int j0, int j1);
+void lbp_row_scalar(const unsigned char* const rows[3], unsigned char* out, int j0, int j1);
+void median_row_scalar(const unsigned char* const rows[3], unsigned char* out, int j0, int j1);
+void resample_rows_scalar(const uint32_t* const* rows, const uint32_t* weights, int taps,
+                          unsigned char* out, int j0, int j1);
+static const ConvKernelSet conv_kernels_scalar;
+
+// kernels picked by select_stencil_kernels() when the library is loaded (scalar until then)
+static StencilKernels stencil_kernels = {
+    "scalar", average_row_scalar, sobel_row_scalar, prewitt_row_scalar, lbp_row_scalar, median_row_scalar,
+    resample_rows_scalar, &conv_kernels_scalar
+};
+void select_stencil_kernels(void) __attribute__((constructor));
+
+// PGM Parsing Helpers
+
+// character classes for the header and P2 scanner, 1 = whitespace, 2 = digit
+static const unsigned char pgm_char_class[256] = {
+    ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1, [' '] = 1,
+    ['0'] = 2, ['1'] = 2, ['2'] = 2, ['3'] = 2, ['4'] = 2,
+    ['5'] = 2, ['6'] = 2, ['7'] = 2, ['8'] = 2, ['9'] = 2
+};
+
+// it is used to skip pgm headers spaces and comments, a comment may start anywhere
+// (even right after a number) and runs to the end of the line
+static const unsigned char* skip_space_and_comments(const unsigned char* p, const unsigned char* end) {
+    while (p < end) {
+        if (*p == '#') {
+            while (p < end && *p != '\n' && *p != '\r') p++;
+        } else if (pgm_char_class[*p] == 1) {
+            p++;
+        } else {
+            break;
+        }
+    }
+    return p;
+}
+
+// reads one unsigned decimal number, returns NULL when there is none
+static const unsigned char* parse_uint(const unsigned char* p, const unsigned char* end, int* out) {
+    p = skip_space_and_comments(p, end);
+    if (p >= end || pgm_char_class[*p] != 2) return NULL;
+    long v = 0;
+    while (p < end && pgm_char_class[*p] == 2) {
+        v = v * 10 + (*p++ - '0');
+        if (v > 0x7fffffff) return NULL;
+    }
+    *out = (int)v;
+    return p;
+}
+
+// parses "P5"/"P2", width, height and max_val from buf
+// on success returns 1 and stores the offset of the first raster byte; 0 means no PGM
+// magic, -1/-2 an invalid size/max_val and -3 that buf ends inside the header
+static int parse_pgm_header(const unsigned char* buf, size_t len, char magic[3],
+                            int* w, int* h, int* max_val, size_t* payload_offset) {
+    const unsigned char* end = buf + len;
+    if (len < 2) return len == 0 || buf[0] == 'P' ? -3 : 0;
+    if (buf[0] != 'P' || (buf[1] != '5' && buf[1] != '2')) return 0;
+    magic[0] = 'P'; magic[1] = (char)buf[1]; magic[2] = '\0';
+
+    const unsigned char* p = buf + 2;
+    const unsigned char* q;
+    if ((q = parse_uint(p, end, w)) == NULL) return skip_space_and_comments(p, end) == end ? -3 : -1;
+    if ((p = parse_uint(q, end, h)) == NULL) return skip_space_and_comments(q, end) == end ? -3 : -1;
+    if ((q = parse_uint(p, end, max_val)) == NULL) return skip_space_and_comments(p, end) == end ? -3 : -2;
+    p = q;
+
+    // a comment may still sit between max_val and the single raster separator
+    if (p < end && *p == '#') {
+        while (p < end && *p != '\n' && *p != '\r') p++;
+    }
+    if (p >= end) return -3;
+    if (pgm_char_class[*p] != 1) return -2;
+    p++;
+
+    // the fields are only checked once the header is complete, a number may go on
+    // in the next block
+    if (*w < 1 || *h < 1 || *w > PGM_MAX_IMAGE_DIM || *h > PGM_MAX_IMAGE_DIM) return -1;
+    if (*max_val < 1 || *max_val > 255) return -2;
+    *payload_offset = (size_t)(p - buf);
+    return 1;
+}
+
+// scalar P2 scanner, continues at pixel index 'count'
+// returns the number of pixels read (== width * height on success)
+static size_t parse_p2_scalar(const unsigned char* p, const unsigned char* end,
+                              PGMImage* img, size_t count) {
+    size_t total = (size_t)img->width * img->height;
+    while (count < total) {
+        if (p < end && pgm_char_class[*p] != 2) {
+            // usual case is exactly one separator before the next number
+            if (pgm_char_class[*p] == 1 && p + 1 < end && pgm_char_class[p[1]] == 2) p++;
+            else p = skip_space_and_comments(p, end);
+            if (p >= end || pgm_char_class[*p] != 2) return count;
+        }
+        unsigned v = (unsigned)(*p++ - '0');
+        unsigned d;
+        while (p < end && (d = (unsigned)(*p - '0')) <= 9) {
+            v = v * 10 + d;
+            p++;
+        }
+        IMG_ROW(img, count / img->width)[count % img->width] = (unsigned char)v;
+        count++;
+    }
+    return count;
+}
+
+#if defined(__SSE2__)
+// bit k of *digits / *spaces is set when p[k] is a digit / whitespace
+static void classify64(const unsigned char* p, uint64_t* digits, uint64_t* spaces) {
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4);
+    const __m128i blank = _mm_set1_epi8(' ');
+    uint64_t d = 0, s = 0;
+    for (int k = 0; k < 4; k++) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + 16 * k));
+        __m128i dv = _mm_sub_epi8(v, zero);
+        __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(dv, nine), dv);
+        __m128i cv = _mm_sub_epi8(v, tab);  // \t \n \v \f \r
+        __m128i is_space = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(cv, four), cv),
+                                        _mm_cmpeq_epi8(v, blank));
+        d |= (uint64_t)(unsigned)_mm_movemask_epi8(is_digit) << (16 * k);
+        s |= (uint64_t)(unsigned)_mm_movemask_epi8(is_space) << (16 * k);
+    }
+    *digits = d;
+    *spaces = s;
+}
+#endif
+
+// hand written P2 raster scanner, no libc call per pixel
+// 64 byte blocks made only of digits and whitespace are decoded from a digit bitmask:
+// every number end is found with one bit scan and numbers of up to 3 digits (all
+// 8-bit samples) are assembled without branching on their length.
+// Comments, long numbers and the tail of the buffer go through the scalar scanner.
+// returns the number of pixels read (== width * height on success)
+static size_t parse_p2_raster(const unsigned char* p, const unsigned char* end,
+                              PGMImage* img) {
+    size_t count = 0;
+#if defined(__SSE2__)
+    // p[-1] is always the whitespace that ends the header, so looking back 3 bytes
+    // from any number end stays inside the buffer
+    const unsigned char* resume = p;  // first byte after the last decoded number
+    const int width = img->width;
+    int row_index = 0, col = 0;
+    unsigned char* row = img->height > 0 ? IMG_ROW(img, 0) : NULL;
+    while (row_index < img->height && width > 0 && end - p > 64) {
+        uint64_t digits, spaces;
+        classify64(p, &digits, &spaces);
+        if ((digits | spaces) != ~(uint64_t)0) break;
+        uint64_t next_digit = (unsigned)(p[64] - '0') <= 9;
+        uint64_t ends = digits & ~((digits >> 1) | (next_digit << 63));
+        while (ends) {
+            const unsigned char* q = p + __builtin_ctzll(ends);
+            ends &= ends - 1;
+            // nd_k is 1 when q[-k] is not a digit, kept as arithmetic so the
+            // compiler does not turn it into (unpredictable) branches
+            int d0 = q[0] - '0', d1 = q[-1] - '0', d2 = q[-2] - '0', d3 = q[-3] - '0';
+            unsigned nd1 = (unsigned)(d1 | (9 - d1)) >> 31;
+            unsigned nd2 = nd1 | ((unsigned)(d2 | (9 - d2)) >> 31);
+            unsigned nd3 = nd2 | ((unsigned)(d3 | (9 - d3)) >> 31);
+            if (__builtin_expect(!nd3, 0)) goto scalar;  // 4+ digits, leave it to the scalar path
+            unsigned v = (unsigned)d0 + ((unsigned)(d1 * 10) & (nd1 - 1)) + ((unsigned)(d2 * 100) & (nd2 - 1));
+            row[col] = (unsigned char)v;
+            resume = q + 1;
+            if (++col == width) {
+                col = 0;
+                row += img->stride;
+                if (++row_index == img->height) return (size_t)width * img->height;
+            }
+        }
+        p += 64;
+    }
+scalar:
+    p = resume;
+    count = (size_t)row_index * width + col;
+#endif
+    return parse_p2_scalar(p, end, img, count);
+}
+
+// General Helpers
+
+
+void free_image_memory(PGMImage* img) {
+    if (img->pixels != NULL) {
+        if (img->map_base != NULL) munmap(img->map_base, img->map_len);
+        buffer_pool_put(img->block);
+        img->block = NULL;
+        img->map_base = NULL;
+        img->map_len = 0;
+        img->pixels = NULL;
+        img->data = NULL;
+        img->width = 0;
+        img->height = 0;
+        img->stride = 0;
+        img->pad = 0;
+        img->max_val = 0;
+        img->format = 0;
+    }
+}
+
+// round n up to the next multiple of PGM_ALIGNMENT
+static size_t align_up(size_t n) {
+    return (n + PGM_ALIGNMENT - 1) & ~(size_t)(PGM_ALIGNMENT - 1);
+}
+
+// one aligned allocation: the row pointer table first, then the pixel rows
+// every row is padded to a multiple of PGM_ALIGNMENT bytes
+int alloc_image_buffer(PGMImage* img, int w, int h, int zero) {
+    return alloc_padded_buffer(img, w, h, 0, zero);
+}
+
+// the same with a guard band of pad pixels: pad extra rows above and below, and pad
+// columns on either side of every row; the left band is rounded up to PGM_ALIGNMENT
+// so the image rows stay aligned
+int alloc_padded_buffer(PGMImage* img, int w, int h, int pad, int zero) {
+    size_t lead = align_up((size_t)pad);
+    size_t stride = align_up(lead + (size_t)(w > 0 ? w : 1) + pad);
+    size_t table = align_up((size_t)h * sizeof(unsigned char*));
+    size_t total = table + ((size_t)h + 2 * (size_t)pad) * stride;
+
+    void* block = buffer_pool_get(total, 0);
+    if (block == NULL) return 0;
+    if (zero) memset((char*)block + table, 0, total - table);
+
+    img->width = w;
+    img->height = h;
+    img->stride = (int)stride;
+    img->pad = pad;
+    img->block = block;
+    img->data = (unsigned char*)block + table + (size_t)pad * stride + lead;
+    img->pixels = (unsigned char**)block;
+    img->map_base = NULL;
+    img->map_len = 0;
+    for (int i = 0; i < h; i++) {
+        img->pixels[i] = IMG_ROW(img, i);
+    }
+    return 1;
+}
+
+// one memcpy when the strides match, up to the last pixel (views end inside a guard band)
+static void copy_pixels(const PGMImage* src, PGMImage* dst) {
+    if (dst->stride == src->stride) {
+        memcpy(dst->data, src->data, (size_t)(src->height - 1) * src->stride + src->width);
+    } else {
+        for (int i = 0; i < src->height; i++) {
+            memcpy(IMG_ROW(dst, i), IMG_ROW(src, i), src->width);
+        }
+    }
+}
+
+static int image_is_valid(const PGMImage* img) {
+    return img != NULL && img->pixels != NULL && img->width > 0 && img->height > 0;
+}
+
+// Sets up the w x h result of an operator on src: an empty dst gets a zeroed pooled
+// buffer (with a guard band when src has a border mode, so the next operator can fill
+// it in place), a dst that holds pixels must have that size and is zeroed in place. With
+// copy_src the result starts as a copy of src (the filters keep the border pixels).
+// *allocated tells the caller whether to free dst again when the operator fails.
+static PgmStatus prepare_output(const PGMImage* src, PGMImage* dst, int w, int h, int copy_src,
+                                int* allocated) {
+    *allocated = 0;
+    if (!image_is_valid(src) || dst == NULL) return PGM_ERR_ARGUMENT;
+    if (dst->pixels == NULL) {
+        int pad = src->border != PGM_BORDER_NONE ? PGM_GUARD_BAND : 0;
+        if (!alloc_padded_buffer(dst, w, h, pad, !copy_src)) return PGM_ERR_NOMEM;
+        *allocated = 1;
+    } else {
+        if (dst->width != w || dst->height != h || dst->map_base != NULL || dst->data == src->data) {
+            return PGM_ERR_ARGUMENT;
+        }
+        if (!copy_src) {
+            for (int i = 0; i < h; i++) memset(IMG_ROW(dst, i), 0, w);
+        }
+    }
+    dst->max_val = src->max_val;
+    dst->border = src->border;
+    dst->border_value = src->border_value;
+    if (copy_src) copy_pixels(src, dst);
+    return PGM_OK;
+}
+
+static PgmStatus fail_output(PGMImage* dst, int allocated, PgmStatus status) {
+    if (allocated) free_image_memory(dst);
+    return status;
+}
+
+// Public API: images and runtime
+
+PgmStatus pgm_image_alloc(PGMImage* img, int width, int height) {
+    if (img == NULL || width < 1 || height < 1) return PGM_ERR_ARGUMENT;
+    memset(img, 0, sizeof(*img));
+    if (!alloc_image_buffer(img, width, height, 1)) return PGM_ERR_NOMEM;
+    img->max_val = 255;
+    return PGM_OK;
+}
+
+// only the row pointer table is allocated; free_image_memory() returns it and
+// leaves the caller's pixels alone
+PgmStatus pgm_image_wrap(PGMImage* img, unsigned char* data, int width, int height, int stride) {
+    if (img == NULL || data == NULL || width < 1 || height < 1 || stride < width) return PGM_ERR_ARGUMENT;
+    unsigned char** rows = (unsigned char**)buffer_pool_get((size_t)height * sizeof(unsigned char*), 0);
+    if (rows == NULL) return PGM_ERR_NOMEM;
+    memset(img, 0, sizeof(*img));
+    img->width = width;
+    img->height = height;
+    img->max_val = 255;
+    img->stride = stride;
+    img->data = data;
+    img->pixels = rows;
+    img->block = rows;
+    for (int i = 0; i < height; i++) rows[i] = IMG_ROW(img, i);
+    return PGM_OK;
+}
+
+PgmStatus pgm_image_copy(const PGMImage* src, PGMImage* dst) {
+    if (!image_is_valid(src) || dst == NULL) return PGM_ERR_ARGUMENT;
+    int allocated;
+    return prepare_output(src, dst, src->width, src->height, 1, &allocated);
+}
+
+// copy-on-write for mapped images: moves the pixels into an owned buffer
+// so the image can be modified in place, no-op for images that already own their pixels
+PgmStatus pgm_image_make_writable(PGMImage* img) {
+    if (!image_is_valid(img)) return PGM_ERR_ARGUMENT;
+    if (img->map_base == NULL) return PGM_OK;
+    PGMImage owned = {0};
+    if (!alloc_image_buffer(&owned, img->width, img->height, 0)) return PGM_ERR_NOMEM;
+    owned.max_val = img->max_val;
+    owned.format = img->format;
+    owned.border = img->border;
+    owned.border_value = img->border_value;
+    copy_pixels(img, &owned);
+    free_image_memory(img);
+    *img = owned;
+    return PGM_OK;
+}
+
+void pgm_image_free(PGMImage* img) {
+    if (img != NULL) free_image_memory(img);
+}
+
+PgmStatus pgm_image_set_border(PGMImage* img, PgmBorderMode mode, int value) {
+    if (img == NULL || mode < PGM_BORDER_NONE || mode > PGM_BORDER_WRAP) return PGM_ERR_ARGUMENT;
+    img->border = mode;
+    img->border_value = value < 0 ? 0 : value > 255 ? 255 : value;
+    return PGM_OK;
+}
+
+void pgm_set_threads(int n) {
+    set_worker_threads(n);
+}
+
+int pgm_thread_count(void) {
+    return worker_thread_count();
+}
+
+const char* pgm_simd_level(void) {
+    return stencil_kernels.name;
+}
+
+void pgm_release_buffers(void) {
+    buffer_pool_clear();
+}
+
+const char* pgm_status_string(PgmStatus status) {
+    switch (status) {
+        case PGM_OK:             return "success";
+        case PGM_ERR_IO:         return "input/output error";
+        case PGM_ERR_FORMAT:     return "not a P5 (binary) or P2 (ascii) PGM format";
+        case PGM_ERR_DIMENSIONS: return "invalid PGM dimensions";
+        case PGM_ERR_MAXVAL:     return "invalid PGM max_val";
+        case PGM_ERR_TRUNCATED:  return "image data ends early";
+        case PGM_ERR_NOMEM:      return "memory allocation failed";
+        case PGM_ERR_ARGUMENT:   return "invalid argument";
+        case PGM_END:            return "end of stream";
+    }
+    return "unknown error";
+}
+
+// Stage Profiling
+// A stage is a begin/end pair on the main thread, stages nest. CPU time is process
+// time, so it includes the worker threads. Heap bytes are measured with
+// malloc_usable_size(); the peak of a stage is the most bytes it had allocated on
+// top of what was live when it began. Mapped input files are not heap and not counted.
+
+typedef struct {
+    const char* name;
+    int depth;
+    int fused;          // part of a fused pass: times are its share of the parent
+    double start;       // seconds since profiling was enabled
+    double wall, cpu;
+    long peak_bytes;
+    long allocs;
+} ProfileRecord;
+
+typedef struct {
+    int record;         // index into profile_records
+    double cpu0;
+    long bytes0, peak_seen, allocs0;
+} ProfileFrame;
+
+static int profile_enabled;
+static double profile_origin;
+static long profile_bytes, profile_peak, profile_allocs;
+static ProfileRecord profile_records[MAX_PROFILE_RECORDS];
+static int profile_record_count;
+static ProfileFrame profile_stack[MAX_PROFILE_DEPTH];
+static int profile_depth;
+
+static double profile_clock(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void profile_track(long delta, int is_alloc) {
+    if (is_alloc) __atomic_add_fetch(&profile_allocs, 1, __ATOMIC_RELAXED);
+    long cur = __atomic_add_fetch(&profile_bytes, delta, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&profile_peak, __ATOMIC_RELAXED);
+    while (cur > peak && !__atomic_compare_exchange_n(&profile_peak, &peak, cur, 1,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void* pgm_malloc(size_t n) {
+    void* p = malloc(n);
+    if (profile_enabled && p != NULL) profile_track((long)malloc_usable_size(p), 1);
+    return p;
+}
+
+void* pgm_calloc(size_t count, size_t n) {
+    void* p = calloc(count, n);
+    if (profile_enabled && p != NULL) profile_track((long)malloc_usable_size(p), 1);
+    return p;
+}
+
+void* pgm_realloc(void* p, size_t n) {
+    if (!profile_enabled) return realloc(p, n);
+    long old = p != NULL ? (long)malloc_usable_size(p) : 0;
+    void* q = realloc(p, n);
+    if (q != NULL) profile_track((long)malloc_usable_size(q) - old, 1);
+    return q;
+}
+
+void* pgm_aligned_alloc(size_t align, size_t n) {
+    void* p = aligned_alloc(align, n);
+    if (profile_enabled && p != NULL) profile_track((long)malloc_usable_size(p), 1);
+    return p;
+}
+
+void pgm_free(void* p) {
+    if (profile_enabled && p != NULL) profile_track(-(long)malloc_usable_size(p), 0);
+    free(p);
+}
+
+void pgm_profile_enable(void) {
+    profile_origin = profile_clock(CLOCK_MONOTONIC);
+    profile_enabled = 1;
+}
+
+void pgm_profile_begin(const char* name) {
+    if (!profile_enabled || profile_depth == MAX_PROFILE_DEPTH) return;
+    ProfileFrame* f = &profile_stack[profile_depth];
+    if (profile_depth > 0) {
+        ProfileFrame* parent = &profile_stack[profile_depth - 1];
+        if (profile_peak > parent->peak_seen) parent->peak_seen = profile_peak;
+    }
+    f->record = -1;
+    if (profile_record_count < MAX_PROFILE_RECORDS) {
+        f->record = profile_record_count++;
+        ProfileRecord* r = &profile_records[f->record];
+        memset(r, 0, sizeof(*r));
+        r->name = name;
+        r->depth = profile_depth;
+        r->start = profile_clock(CLOCK_MONOTONIC) - profile_origin;
+    }
+    // the peak restarts at the live bytes, the parent keeps what it saw so far
+    profile_peak = profile_bytes;
+    f->bytes0 = f->peak_seen = profile_bytes;
+    f->allocs0 = profile_allocs;
+    f->cpu0 = profile_clock(CLOCK_PROCESS_CPUTIME_ID);
+    profile_depth++;
+}
+
+void pgm_profile_end(void) {
+    if (!profile_enabled || profile_depth == 0) return;
+    ProfileFrame* f = &profile_stack[--profile_depth];
+    if (profile_peak > f->peak_seen) f->peak_seen = profile_peak;
+    if (profile_depth > 0 && f->peak_seen > profile_stack[profile_depth - 1].peak_seen) {
+        profile_stack[profile_depth - 1].peak_seen = f->peak_seen;
+    }
+    if (f->record < 0) return;
+    ProfileRecord* r = &profile_records[f->record];
+    r->wall = profile_clock(CLOCK_MONOTONIC) - profile_origin - r->start;
+    r->cpu = profile_clock(CLOCK_PROCESS_CPUTIME_ID) - f->cpu0;
+    r->peak_bytes = f->peak_seen - f->bytes0;
+    r->allocs = profile_allocs - f->allocs0;
+}
+
+// sub-stages of the stage that just ended which ran interleaved row by row; they get
+// the summed thread time as CPU time and the same share of the parent's wall time
+static void profile_add_fused(const char* names[], const double thread_seconds[], int count) {
+    if (!profile_enabled || profile_record_count == 0) return;
+    const ProfileRecord* parent = &profile_records[profile_record_count - 1];
+    double total = 0;
+    for (int k = 0; k < count; k++) total += thread_seconds[k];
+    double start = parent->start;
+    for (int k = 0; k < count && profile_record_count < MAX_PROFILE_RECORDS; k++) {
+        ProfileRecord* r = &profile_records[profile_record_count++];
+        memset(r, 0, sizeof(*r));
+        r->name = names[k];
+        r->depth = parent->depth + 1;
+        r->fused = 1;
+        r->start = start;
+        r->wall = total > 0 ? parent->wall * thread_seconds[k] / total : 0;
+        r->cpu = thread_seconds[k];
+        start += r->wall;
+    }
+}
+
+void pgm_profile_report(FILE* out) {
+    fprintf(out, "%-28s %10s %10s %10s %8s\n", "stage", "wall ms", "cpu ms", "peak KB", "allocs");
+    int any_fused = 0;
+    for (int k = 0; k < profile_record_count; k++) {
+        const ProfileRecord* r = &profile_records[k];
+        char label[64];
+        snprintf(label, sizeof(label), "%*s%s%s", 2 * r->depth, "", r->name, r->fused ? " *" : "");
+        if (r->fused) {
+            any_fused = 1;
+            fprintf(out, "%-28s %10.3f %10.3f %10s %8s\n", label, r->wall * 1e3, r->cpu * 1e3, "-", "-");
+        } else {
+            fprintf(out, "%-28s %10.3f %10.3f %10.1f %8ld\n", label, r->wall * 1e3, r->cpu * 1e3,
+                    r->peak_bytes / 1024.0, r->allocs);
+        }
+    }
+    if (any_fused) fprintf(out, "* fused pass: CPU time summed over the threads, wall time is its share of the pass\n");
+}
+
+// Chrome trace-event format, opens in chrome://tracing or Perfetto
+PgmStatus pgm_profile_write_trace(const char* filename) {
+    FILE* fp = fopen(filename, "w");
+    if (fp == NULL) return PGM_ERR_IO;
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (int k = 0; k < profile_record_count; k++) {
+        const ProfileRecord* r = &profile_records[k];
+        fprintf(fp, "  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, "
+                "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"cpu_ms\": %.3f",
+                r->name, r->fused ? "fused" : "stage", r->start * 1e6, r->wall * 1e6, r->cpu * 1e3);
+        if (!r->fused) fprintf(fp, ", \"peak_bytes\": %ld, \"allocs\": %ld", r->peak_bytes, r->allocs);
+        fprintf(fp, "}}%s\n", k + 1 < profile_record_count ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    return fclose(fp) == 0 ? PGM_OK : PGM_ERR_IO;
+}
+
+// Buffer Pool
+// Every block carries its capacity in a header one alignment unit in front of it.
+// get() takes the smallest free block that fits and is at most about twice the
+// request, so small scratch never claims a block an image will need next.
+
+typedef struct {
+    size_t capacity;
+} PoolHeader;
+
+static pthread_mutex_t buffer_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static PoolHeader* buffer_pool_free[BUFFER_POOL_SLOTS];
+static int buffer_pool_count;
+
+#define POOL_HEADER_SIZE PGM_ALIGNMENT
+#define POOL_SLACK 4096
+
+static PoolHeader* pool_header(void* p) {
+    return (PoolHeader*)((unsigned char*)p - POOL_HEADER_SIZE);
+}
+
+void* buffer_pool_get(size_t n, int zero) {
+    PoolHeader* h = NULL;
+    pthread_mutex_lock(&buffer_pool_lock);
+    int best = -1;
+    for (int k = 0; k < buffer_pool_count; k++) {
+        size_t cap = buffer_pool_free[k]->capacity;
+        if (cap >= n && cap <= 2 * n + POOL_SLACK &&
+            (best < 0 || cap < buffer_pool_free[best]->capacity)) best = k;
+    }
+    if (best >= 0) {
+        h = buffer_pool_free[best];
+        buffer_pool_free[best] = buffer_pool_free[--buffer_pool_count];
+    }
+    pthread_mutex_unlock(&buffer_pool_lock);
+
+    if (h == NULL) {
+        size_t cap = (n + PGM_ALIGNMENT - 1) & ~(size_t)(PGM_ALIGNMENT - 1);
+        h = (PoolHeader*)pgm_aligned_alloc(PGM_ALIGNMENT, POOL_HEADER_SIZE + (cap > 0 ? cap : PGM_ALIGNMENT));
+        if (h == NULL) return NULL;
+        h->capacity = cap;
+    }
+    void* p = (unsigned char*)h + POOL_HEADER_SIZE;
+    if (zero) memset(p, 0, n);
+    return p;
+}
+
+// realloc for pool blocks, the old contents are kept
+void* buffer_pool_grow(void* p, size_t n) {
+    if (p == NULL) return buffer_pool_get(n, 0);
+    size_t cap = pool_header(p)->capacity;
+    if (cap >= n) return p;
+    void* q = buffer_pool_get(n, 0);
+    if (q == NULL) return NULL;
+    memcpy(q, p, cap);
+    buffer_pool_put(p);
+    return q;
+}
+
+void buffer_pool_put(void* p) {
+    if (p == NULL) return;
+    PoolHeader* h = pool_header(p);
+    pthread_mutex_lock(&buffer_pool_lock);
+    if (buffer_pool_count < BUFFER_POOL_SLOTS) {
+        buffer_pool_free[buffer_pool_count++] = h;
+        h = NULL;
+    }
+    pthread_mutex_unlock(&buffer_pool_lock);
+    pgm_free(h);
+}
+
+// hands every pooled block back to the heap
+void buffer_pool_clear(void) {
+    pthread_mutex_lock(&buffer_pool_lock);
+    for (int k = 0; k < buffer_pool_count; k++) pgm_free(buffer_pool_free[k]);
+    buffer_pool_count = 0;
+    pthread_mutex_unlock(&buffer_pool_lock);
+}
+
+// Worker Pool
+// One pool per process, started on first use. A job is a row range cut into fixed
+// chunks of `grain` rows; the chunk boundaries depend only on the range and the grain,
+// never on the thread count, and every chunk writes its own rows, so results are the
+// same with any number of threads. Each worker starts on an even share of the chunks
+// and, once its share is done, steals the upper half of the largest remaining share.
+
+typedef struct {
+    pthread_mutex_t lock;
+    int next, end;  // chunks [next, end) not yet taken from this worker
+} PoolQueue;
+
+static struct {
+    pthread_mutex_t lock;        // guards generation / pending
+    pthread_cond_t wake, done;
+    pthread_mutex_t job_lock;    // one job at a time
+    int nthreads;                // workers including the calling thread, 0 = not started
+    unsigned long generation;
+    int pending;                 // helper threads still inside the current job
+    RowRangeFn fn;
+    void* ctx;
+    int y0, y1, grain;
+    PoolQueue queues[MAX_WORKER_THREADS];
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER,
+           .done = PTHREAD_COND_INITIALIZER, .job_lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int requested_threads = 0;
+static __thread int inside_pool_job = 0;
+
+// number of threads for the parallel stages: --threads, else PGM_THREADS, else the online CPUs
+int worker_thread_count(void) {
+    long n = requested_threads;
+    if (n <= 0) {
+        const char* env = getenv("PGM_THREADS");
+        n = (env != NULL && atoi(env) > 0) ? atoi(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (n < 1) n = 1;
+    if (n > MAX_WORKER_THREADS) n = MAX_WORKER_THREADS;
+    return (int)n;
+}
+
+// takes effect when the pool starts, i.e. before the first parallel operation
+void set_worker_threads(int n) {
+    requested_threads = n;
+}
+
+static int pool_take(int self, int* chunk) {
+    PoolQueue* q = &pool.queues[self];
+    pthread_mutex_lock(&q->lock);
+    int ok = q->next < q->end;
+    if (ok) *chunk = q->next++;
+    pthread_mutex_unlock(&q->lock);
+    if (ok) return 1;
+
+    // own share done: steal the upper half of the fullest queue
+    for (;;) {
+        int victim = -1, most = 0;
+        for (int v = 0; v < pool.nthreads; v++) {
+            if (v == self) continue;
+            pthread_mutex_lock(&pool.queues[v].lock);
+            int left = pool.queues[v].end - pool.queues[v].next;
+            pthread_mutex_unlock(&pool.queues[v].lock);
+            if (left > most) { most = left; victim = v; }
+        }
+        if (victim < 0) return 0;
+        PoolQueue* vq = &pool.queues[victim];
+        pthread_mutex_lock(&vq->lock);
+        int left = vq->end - vq->next;
+        int lo = 0, hi = 0;
+        if (left > 0) {
+            lo = vq->end - (left + 1) / 2;
+            hi = vq->end;
+            vq->end = lo;
+        }
+        pthread_mutex_unlock(&vq->lock);
+        if (hi > lo) {
+            *chunk = lo;
+            pthread_mutex_lock(&q->lock);
+            q->next = lo + 1;
+            q->end = hi;
+            pthread_mutex_unlock(&q->lock);
+            return 1;
+        }
+    }
+}
+
+static void pool_work(int self) {
+    int chunk;
+    inside_pool_job = 1;
+    while (pool_take(self, &chunk)) {
+        int a = pool.y0 + chunk * pool.grain;
+        int b = a + pool.grain < pool.y1 ? a + pool.grain : pool.y1;
+        pool.fn(pool.ctx, a, b);
+    }
+    inside_pool_job = 0;
+}
+
+static void* pool_thread(void* arg) {
+    int self = (int)(intptr_t)arg;
+    unsigned long seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.generation == seen) pthread_cond_wait(&pool.wake, &pool.lock);
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        pool_work(self);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.pending == 0) pthread_cond_signal(&pool.done);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+// called with job_lock held
+static void pool_start(void) {
+    int n = worker_thread_count();
+    for (int k = 0; k < n; k++) pthread_mutex_init(&pool.queues[k].lock, NULL);
+    pool.nthreads = 1;
+    for (int k = 1; k < n; k++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, pool_thread, (void*)(intptr_t)k) != 0) break;
+        pthread_detach(t);
+        pool.nthreads++;
+    }
+}
+
+// rows per chunk so one chunk is roughly 64K pixels of work, at least min_rows
+int parallel_grain(int width, int min_rows) {
+    int rows = (64 * 1024) / (width > 0 ? width : 1);
+    if (rows < min_rows) rows = min_rows;
+    return rows > 0 ? rows : 1;
+}
+
+// runs fn(ctx, a, b) over [y0, y1) in chunks of grain rows on the pool; returns when all are done
+void parallel_rows(int y0, int y1, int grain, RowRangeFn fn, void* ctx) {
+    if (y1 <= y0) return;
+    if (grain < 1) grain = 1;
+    int chunks = (y1 - y0 + grain - 1) / grain;
+
+    // nested calls and single chunks run on the calling thread
+    if (inside_pool_job || chunks == 1) {
+        fn(ctx, y0, y1);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.job_lock);
+    if (pool.nthreads == 0) pool_start();
+    if (pool.nthreads == 1) {
+        pthread_mutex_unlock(&pool.job_lock);
+        fn(ctx, y0, y1);
+        return;
+    }
+
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.y0 = y0;
+    pool.y1 = y1;
+    pool.grain = grain;
+    for (int k = 0; k < pool.nthreads; k++) {
+        pool.queues[k].next = (int)((long)chunks * k / pool.nthreads);
+        pool.queues[k].end = (int)((long)chunks * (k + 1) / pool.nthreads);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.pending = pool.nthreads - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    pool_work(0);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.pending > 0) pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.job_lock);
+}
+
+// 1. Load PGM File 
+
+// reads a whole non seekable input (pipe, fifo) into one growing buffer
+static unsigned char* read_whole_fd(int fd, size_t* out_len) {
+    size_t cap = 1 << 20, len = 0;
+    unsigned char* buf = (unsigned char*)pgm_malloc(cap);
+    if (buf == NULL) return NULL;
+    for (;;) {
+        if (len == cap) {
+            unsigned char* bigger = (unsigned char*)pgm_realloc(buf, cap * 2);
+            if (bigger == NULL) { pgm_free(buf); return NULL; }
+            buf = bigger; cap *= 2;
+        }
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n < 0) { pgm_free(buf); return NULL; }
+        if (n == 0) break;
+        len += (size_t)n;
+    }
+    *out_len = len;
+    return buf;
+}
+
+static void release_file_buffer(unsigned char* buf, size_t len, int mapped) {
+    if (mapped) munmap(buf, len);
+    else pgm_free(buf);
+}
+
+static PgmStatus header_status(int rc) {
+    if (rc == 0) return PGM_ERR_FORMAT;
+    if (rc == -3) return PGM_ERR_TRUNCATED;
+    return rc == -1 ? PGM_ERR_DIMENSIONS : PGM_ERR_MAXVAL;
+}
+
+PgmStatus pgm_parse_header(const void* buf, size_t len, int* format, int* width, int* height,
+                           int* max_val, size_t* offset) {
+    char magic[3];
+    int rc = parse_pgm_header((const unsigned char*)buf, len, magic, width, height, max_val, offset);
+    if (rc != 1) return header_status(rc);
+    *format = magic[1] - '0';
+    return PGM_OK;
+}
+
+// Parses the image in buf. With a file mapping the P5 pixels are used in place and
+// the image takes over the mapping (*adopted = 1); everything else is copied out.
+static PgmStatus decode_image(const unsigned char* buf, size_t len, int mapped, PGMImage* img,
+                              int* adopted) {
+    *adopted = 0;
+    char magic[3];
+    int w = 0, h = 0, max_val = 0;
+    size_t offset = 0;
+    int rc = parse_pgm_header(buf, len, magic, &w, &h, &max_val, &offset);
+    if (rc != 1) return header_status(rc);
+
+    size_t npix = (size_t)w * h;
+    if (magic[1] == '5') {
+        if (len - offset < npix) return PGM_ERR_TRUNCATED;
+        if (mapped) {
+            // zero-copy: only the row pointer view is allocated
+            unsigned char** rows = (unsigned char**)buffer_pool_get((size_t)h * sizeof(unsigned char*), 0);
+            if (rows == NULL) return PGM_ERR_NOMEM;
+            img->width = w;
+            img->height = h;
+            img->max_val = max_val;
+            img->stride = w;
+            img->data = (unsigned char*)buf + offset;
+            img->pixels = rows;
+            img->block = rows;
+            img->map_base = (void*)buf;
+            img->map_len = len;
+            for (int i = 0; i < h; i++) rows[i] = IMG_ROW(img, i);
+            *adopted = 1;
+        } else {
+            if (!alloc_image_buffer(img, w, h, 0)) return PGM_ERR_NOMEM;
+            img->max_val = max_val;
+            for (int i = 0; i < h; i++) {
+                memcpy(IMG_ROW(img, i), buf + offset + (size_t)i * w, w);
+            }
+        }
+    } else {
+        if (!alloc_image_buffer(img, w, h, 0)) return PGM_ERR_NOMEM;
+        img->max_val = max_val;
+        size_t got = parse_p2_raster(buf + offset, buf + len, img);
+        if (got != npix) {
+            free_image_memory(img);
+            return PGM_ERR_TRUNCATED;
+        }
+    }
+    img->format = magic[1] - '0';
+    return PGM_OK;
+}
+
+// P5 files are memory mapped and used in place: data points into the mapping and
+// the image is read-only until pgm_image_make_writable() is called on it.
+// P2 files are scanned straight out of the mapping into an owned buffer.
+PgmStatus pgm_load(const char* filename, PGMImage* img) {
+    if (filename == NULL || img == NULL) return PGM_ERR_ARGUMENT;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return PGM_ERR_IO;
+
+    unsigned char* buf = NULL;
+    size_t len = 0;
+    int mapped = 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            buf = (unsigned char*)m;
+            len = (size_t)st.st_size;
+            mapped = 1;
+            madvise(m, len, MADV_SEQUENTIAL);
+        }
+    }
+    if (!mapped) buf = read_whole_fd(fd, &len);
+    int saved_errno = errno;
+    close(fd);
+    if (buf == NULL) {
+        errno = saved_errno;
+        return PGM_ERR_IO;
+    }
+
+    int adopted;
+    PgmStatus status = decode_image(buf, len, mapped, img, &adopted);
+    if (!adopted) release_file_buffer(buf, len, mapped);
+    return status;
+}
+
+PgmStatus pgm_decode(const void* data, size_t len, PGMImage* img) {
+    if (data == NULL || img == NULL) return PGM_ERR_ARGUMENT;
+    int adopted;
+    return decode_image((const unsigned char*)data, len, 0, img, &adopted);
+}
+
+// 6. Save the  PGM File
+static int encode_header(const PGMImage* img, char* out, size_t cap) {
+    return snprintf(out, cap, "P5\n%d %d\n%d\n", img->width, img->height, img->max_val);
+}
+
+PgmStatus pgm_write(const PGMImage* img, FILE* fp) {
+    if (!image_is_valid(img) || fp == NULL) return PGM_ERR_ARGUMENT;
+    char header[64];
+    encode_header(img, header, sizeof(header));
+    int ok = fputs(header, fp) >= 0;
+    for (int i = 0; ok && i < img->height; i++) {
+        ok = fwrite(IMG_ROW(img, i), sizeof(unsigned char), img->width, fp) == (size_t)img->width;
+    }
+    return ok ? PGM_OK : PGM_ERR_IO;
+}
+
+PgmStatus pgm_save(const PGMImage* img, const char* filename) {
+    if (!image_is_valid(img) || filename == NULL) return PGM_ERR_ARGUMENT;
+    FILE* fp = fopen(filename, "wb"); 
+    if (fp == NULL) return PGM_ERR_IO;
+    PgmStatus status = pgm_write(img, fp);
+    int saved_errno = errno;
+    if (fclose(fp) != 0 && status == PGM_OK) return PGM_ERR_IO;
+    errno = saved_errno;
+    return status;
+}
+
+// Frames of a multi-image stream. The header is read byte by byte, it is short and
+// reading ahead would eat into the next frame; the raster goes straight into the rows.
+PgmStatus pgm_read(FILE* fp, PGMImage* img) {
+    if (fp == NULL || img == NULL) return PGM_ERR_ARGUMENT;
+    unsigned char header[PGM_MAX_HEADER];
+    size_t len = 0;
+    int c;
+    // whitespace between frames is allowed
+    while ((c = getc(fp)) != EOF && pgm_char_class[c] == 1) {
+    }
+    if (c == EOF) return ferror(fp) ? PGM_ERR_IO : PGM_END;
+    header[len++] = (unsigned char)c;
+
+    char magic[3];
+    int w = 0, h = 0, max_val = 0;
+    size_t offset;
+    for (;;) {
+        int rc = parse_pgm_header(header, len, magic, &w, &h, &max_val, &offset);
+        if (rc == 1) break;
+        if (rc != -3 || len == sizeof(header)) return header_status(rc);
+        if ((c = getc(fp)) == EOF) return ferror(fp) ? PGM_ERR_IO : PGM_ERR_TRUNCATED;
+        header[len++] = (unsigned char)c;
+    }
+    // P2 frames have no size in bytes, so only P5 can follow one another
+    if (magic[1] != '5') return PGM_ERR_FORMAT;
+
+    if (!alloc_image_buffer(img, w, h, 0)) return PGM_ERR_NOMEM;
+    img->max_val = max_val;
+    img->format = 5;
+    for (int i = 0; i < h; i++) {
+        if (fread(IMG_ROW(img, i), 1, w, fp) != (size_t)w) {
+            PgmStatus status = ferror(fp) ? PGM_ERR_IO : PGM_ERR_TRUNCATED;
+            free_image_memory(img);
+            return status;
+        }
+    }
+    return PGM_OK;
+}
+
+size_t pgm_encoded_size(const PGMImage* img) {
+    if (!image_is_valid(img)) return 0;
+    char header[64];
+    return (size_t)encode_header(img, header, sizeof(header)) + (size_t)img->width * img->height;
+}
+
+PgmStatus pgm_encode(const PGMImage* img, void* buf, size_t cap, size_t* len) {
+    if (!image_is_valid(img) || buf == NULL) return PGM_ERR_ARGUMENT;
+    size_t need = pgm_encoded_size(img);
+    if (cap < need) return PGM_ERR_ARGUMENT;
+    char header[64];
+    int n = encode_header(img, header, sizeof(header));
+    unsigned char* out = (unsigned char*)buf;
+    memcpy(out, header, (size_t)n);
+    out += n;
+    for (int i = 0; i < img->height; i++) {
+        memcpy(out, IMG_ROW(img, i), img->width);
+        out += img->width;
+    }
+    if (len != NULL) *len = need;
+    return PGM_OK;
+}
+
+// 2. Zoom or Shrink the Image
+// Resampling is separable: every output column and every output row has a list of
+// source taps with Q16 weights that sum to exactly 1 << 16, built once per call. A
+// source row is first reduced horizontally into Q8 sums, then output rows blend those
+// sums vertically (the SIMD part) and round at the end. Nearest is a plain table
+// lookup and matches the old integer zoom and subsample exactly. Area averages the
+// source pixels the output pixel covers (partial pixels weighted by coverage), so
+// shrinking does not alias; bilinear uses pixel-center alignment.
+
+typedef struct {
+    int* start;         // first source index of every output index
+    int* count;         // taps of every output index
+    int* offset;        // position of its first weight in weights[]
+    uint32_t* weights;
+    int max_taps;
+} ResampleAxis;
+
+static void free_resample_axis(ResampleAxis* ax) {
+    buffer_pool_put(ax->start);
+    buffer_pool_put(ax->count);
+    buffer_pool_put(ax->offset);
+    buffer_pool_put(ax->weights);
+}
+
+// taps mapping dst_n outputs onto src_n inputs, returns 0 when out of memory
+static int build_resample_axis(ResampleAxis* ax, int src_n, int dst_n, ResampleMode mode) {
+    double scale = (double)src_n / dst_n;
+    int cap = mode == RESAMPLE_AREA ? (int)ceil(scale) + 1 : (mode == RESAMPLE_BILINEAR ? 2 : 1);
+    ax->start = (int*)buffer_pool_get((size_t)dst_n * sizeof(int), 0);
+    ax->count = (int*)buffer_pool_get((size_t)dst_n * sizeof(int), 0);
+    ax->offset = (int*)buffer_pool_get((size_t)dst_n * sizeof(int), 0);
+    ax->weights = (uint32_t*)buffer_pool_get((size_t)dst_n * cap * sizeof(uint32_t), 0);
+    ax->max_taps = 1;
+    if (ax->start == NULL || ax->count == NULL || ax->offset == NULL || ax->weights == NULL) {
+        free_resample_axis(ax);
+        return 0;
+    }
+
+    const int one = 1 << RESAMPLE_SHIFT;
+    int used = 0;
+    for (int j = 0; j < dst_n; j++) {
+        uint32_t* w = ax->weights + used;
+        int start, count;
+        if (mode == RESAMPLE_NEAREST) {
+            start = (int)((long long)j * src_n / dst_n);
+            count = 1;
+            w[0] = one;
+        } else if (mode == RESAMPLE_BILINEAR) {
+            double sx = (j + 0.5) * scale - 0.5;
+            if (sx < 0) sx = 0;
+            start = (int)sx;
+            int frac = start >= src_n - 1 ? 0 : (int)lround((sx - start) * one);
+            if (start >= src_n - 1) start = src_n - 1;
+            if (frac == one) { start++; frac = 0; }
+            count = frac == 0 ? 1 : 2;
+            w[0] = (uint32_t)(one - frac);
+            w[1] = (uint32_t)frac;
+        } else {
+            double a = j * scale, b = (j + 1) * scale;
+            start = (int)a;
+            int end = (int)ceil(b);
+            if (end > src_n) end = src_n;
+            if (end <= start) end = start + 1;
+            count = end - start;
+            // coverage of every tap; rounding the running total instead of each weight
+            // keeps the sum exact and every weight within one unit
+            long prev = 0;
+            for (int t = 0; t < count; t++) {
+                double hi = start + t + 1 < b ? start + t + 1 : b;
+                long cum = t == count - 1 ? one : lround((hi - a) / scale * one);
+                if (cum > one) cum = one;
+                w[t] = (uint32_t)(cum - prev);
+                prev = cum;
+            }
+        }
+        ax->start[j] = start;
+        ax->count[j] = count;
+        ax->offset[j] = used;
+        used += count;
+        if (count > ax->max_taps) ax->max_taps = count;
+    }
+    return 1;
+}
+
+// horizontal pass: Q8 blend of the taps of every output column (at most 255 << 8)
+static void resample_row_h(const unsigned char* src, const ResampleAxis* ax, int dst_w, uint32_t* out) {
+    const uint32_t half = 1u << (RESAMPLE_SHIFT - RESAMPLE_MID_BITS - 1);
+    for (int x = 0; x < dst_w; x++) {
+        const unsigned char* p = src + ax->start[x];
+        const uint32_t* w = ax->weights + ax->offset[x];
+        uint32_t acc = half;
+        for (int t = 0; t < ax->count[x]; t++) acc += p[t] * w[t];
+        out[x] = acc >> (RESAMPLE_SHIFT - RESAMPLE_MID_BITS);
+    }
+}
+
+// vertical pass, scalar reference: out[x] for j0 <= x < j1 from `taps` horizontal rows.
+// Q8 rows times Q16 weights stay below 2^32, so 32-bit lanes are enough.
+void resample_rows_scalar(const uint32_t* const* rows, const uint32_t* weights, int taps,
+                          unsigned char* out, int j0, int j1) {
+    for (int x = j0; x < j1; x++) {
+        uint32_t acc = 1u << (RESAMPLE_OUT_SHIFT - 1);
+        for (int t = 0; t < taps; t++) acc += rows[t][x] * weights[t];
+        out[x] = (unsigned char)(acc >> RESAMPLE_OUT_SHIFT);
+    }
+}
+
+typedef struct {
+    const PGMImage* src;
+    PGMImage* dst;
+    const ResampleAxis* ax;
+    const ResampleAxis* ay;
+    ResampleMode mode;
+    int failed;
+} ResampleJob;
+
+static void resample_job_rows(void* arg, int y0, int y1) {
+    ResampleJob* job = (ResampleJob*)arg;
+    int dst_w = job->dst->width;
+    const ResampleAxis* ax = job->ax;
+    const ResampleAxis* ay = job->ay;
+
+    if (job->mode == RESAMPLE_NEAREST) {
+        for (int i = y0; i < y1; i++) {
+            const unsigned char* src = IMG_ROW(job->src, ay->start[i]);
+            unsigned char* dst = IMG_ROW(job->dst, i);
+            for (int x = 0; x < dst_w; x++) dst[x] = src[ax->start[x]];
+        }
+        return;
+    }
+
+    // horizontal rows are cached in max_taps slots, source row r lives in slot r % slots
+    int slots = ay->max_taps;
+    uint32_t* cache = (uint32_t*)buffer_pool_get((size_t)slots * dst_w * sizeof(uint32_t), 0);
+    int* tag = (int*)buffer_pool_get((size_t)slots * sizeof(int), 0);
+    const uint32_t** rows = (const uint32_t**)buffer_pool_get((size_t)slots * sizeof(uint32_t*), 0);
+    if (cache == NULL || tag == NULL || rows == NULL) {
+        buffer_pool_put(cache); buffer_pool_put(tag); buffer_pool_put(rows);
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    for (int k = 0; k < slots; k++) tag[k] = -1;
+
+    for (int i = y0; i < y1; i++) {
+        for (int t = 0; t < ay->count[i]; t++) {
+            int r = ay->start[i] + t;
+            uint32_t* slot = cache + (size_t)(r % slots) * dst_w;
+            if (tag[r % slots] != r) {
+                resample_row_h(IMG_ROW(job->src, r), ax, dst_w, slot);
+                tag[r % slots] = r;
+            }
+            rows[t] = slot;
+        }
+        stencil_kernels.resample(rows, ay->weights + ay->offset[i], ay->count[i], IMG_ROW(job->dst, i), 0, dst_w);
+    }
+    buffer_pool_put(cache);
+    buffer_pool_put(tag);
+    buffer_pool_put(rows);
+}
+
+// resamples src into a new_w x new_h dst
+PgmStatus pgm_resize(const PGMImage* src, PGMImage* dst, int new_w, int new_h, ResampleMode mode) {
+    if (new_w < 1 || new_h < 1 || new_w > PGM_MAX_IMAGE_DIM || new_h > PGM_MAX_IMAGE_DIM ||
+        mode < RESAMPLE_NEAREST || mode > RESAMPLE_AREA) return PGM_ERR_ARGUMENT;
+    int allocated;
+    PgmStatus status = prepare_output(src, dst, new_w, new_h, 0, &allocated);
+    if (status != PGM_OK) return status;
+    ResampleAxis ax = {0}, ay = {0};
+    int ok = build_resample_axis(&ax, src->width, new_w, mode) &&
+             build_resample_axis(&ay, src->height, new_h, mode);
+    if (ok) {
+        ResampleJob job = { src, dst, &ax, &ay, mode, 0 };
+        parallel_rows(0, new_h, parallel_grain(new_w, 1), resample_job_rows, &job);
+        ok = !job.failed;
+    }
+    free_resample_axis(&ax);
+    free_resample_axis(&ay);
+    return ok ? PGM_OK : fail_output(dst, allocated, PGM_ERR_NOMEM);
+}
+
+
+// Gaussian Pyramid
+// Each level is the level above blurred with the 5x5 binomial kernel
+// [1 4 6 4 1]^T [1 4 6 4 1] / 256 and decimated by two, in one fused pass: the blur
+// is only evaluated at the kept (even) positions, so a level costs a quarter of a
+// full-size blur. Rows are filtered horizontally into 16-bit sums (at most
+// 16 * 255) kept in a five row ring, then blended vertically with a rounding shift.
+// Borders repeat the edge pixel; odd sizes round up, so level k of a w wide image is
+// ceil(w / 2^k) wide and pixel (x, y) of the source maps to (x >> k, y >> k).
+
+typedef struct {
+    const PGMImage* src;
+    PGMImage* dst;
+    int failed;
+} ReduceJob;
+
+static inline int clamp_index(int v, int n) {
+    return v < 0 ? 0 : (v >= n ? n - 1 : v);
+}
+
+static inline uint16_t reduce_tap_clamped(const unsigned char* s, int src_w, int x) {
+    int c = 2 * x;
+    return (uint16_t)(s[clamp_index(c - 2, src_w)] + 4 * s[clamp_index(c - 1, src_w)] + 6 * s[c] +
+                      4 * s[clamp_index(c + 1, src_w)] + s[clamp_index(c + 2, src_w)]);
+}
+
+static void reduce_row_h(const unsigned char* s, int src_w, int dst_w, uint16_t* out) {
+    // outputs 1 .. x1 - 1 have all five taps inside the row
+    int x1 = src_w >= 3 ? (src_w - 3) / 2 + 1 : 1;
+    if (x1 > dst_w) x1 = dst_w;
+    out[0] = reduce_tap_clamped(s, src_w, 0);
+    for (int x = 1; x < x1; x++) {
+        const unsigned char* p = s + 2 * x;
+        out[x] = (uint16_t)(p[-2] + 4 * p[-1] + 6 * p[0] + 4 * p[1] + p[2]);
+    }
+    for (int x = x1 > 1 ? x1 : 1; x < dst_w; x++) out[x] = reduce_tap_clamped(s, src_w, x);
+}
+
+static void reduce_job_rows(void* arg, int y0, int y1) {
+    ReduceJob* job = (ReduceJob*)arg;
+    int src_w = job->src->width, src_h = job->src->height;
+    int dst_w = job->dst->width;
+    // horizontal rows in five slots, source row r lives in slot r % 5
+    uint16_t* ring = (uint16_t*)buffer_pool_get((size_t)5 * dst_w * sizeof(uint16_t), 0);
+    if (ring == NULL) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    int tag[5] = { -1, -1, -1, -1, -1 };
+    for (int y = y0; y < y1; y++) {
+        const uint16_t* rows[5];
+        for (int t = 0; t < 5; t++) {
+            int r = clamp_index(2 * y - 2 + t, src_h);
+            uint16_t* slot = ring + (size_t)(r % 5) * dst_w;
+            if (tag[r % 5] != r) {
+                reduce_row_h(IMG_ROW(job->src, r), src_w, dst_w, slot);
+                tag[r % 5] = r;
+            }
+            rows[t] = slot;
+        }
+        unsigned char* out = IMG_ROW(job->dst, y);
+        for (int x = 0; x < dst_w; x++) {
+            uint32_t v = rows[0][x] + 4u * rows[1][x] + 6u * rows[2][x] + 4u * rows[3][x] + rows[4][x];
+            out[x] = (unsigned char)((v + 128) >> 8);
+        }
+    }
+    buffer_pool_put(ring);
+}
+
+PgmStatus pgm_pyramid_reduce(const PGMImage* src, PGMImage* dst) {
+    if (!image_is_valid(src)) return PGM_ERR_ARGUMENT;
+    int allocated;
+    int dst_w = (src->width + 1) / 2, dst_h = (src->height + 1) / 2;
+    PgmStatus status = prepare_output(src, dst, dst_w, dst_h, 0, &allocated);
+    if (status != PGM_OK) return status;
+    ReduceJob job = { src, dst, 0 };
+    // rows are grouped so a band reuses most of its horizontal rows
+    parallel_rows(0, dst_h, parallel_grain(dst_w, 8), reduce_job_rows, &job);
+    return job.failed ? fail_output(dst, allocated, PGM_ERR_NOMEM) : PGM_OK;
+}
+
+PgmStatus pgm_pyramid_build(const PGMImage* src, int levels, PgmPyramid* pyr) {
+    if (!image_is_valid(src) || pyr == NULL || levels < 1 || levels > PGM_MAX_PYRAMID_LEVELS) {
+        return PGM_ERR_ARGUMENT;
+    }
+    memset(pyr, 0, sizeof(*pyr));
+    PgmStatus status = pgm_image_copy(src, &pyr->level[0]);
+    if (status != PGM_OK) return status;
+    pyr->levels = 1;
+    while (pyr->levels < levels) {
+        const PGMImage* top = &pyr->level[pyr->levels - 1];
+        if (top->width == 1 && top->height == 1) break;
+        status = pgm_pyramid_reduce(top, &pyr->level[pyr->levels]);
+        if (status != PGM_OK) {
+            pgm_pyramid_free(pyr);
+            return status;
+        }
+        pyr->levels++;
+    }
+    return PGM_OK;
+}
+
+static PgmStatus run_level_op(const PGMImage* src, PGMImage* dst, PgmLevelOp op,
+                              const PgmCannyThresholds* thresholds) {
+    switch (op) {
+        case PGM_LEVEL_SOBEL:       return pgm_sobel(src, dst);
+        case PGM_LEVEL_PREWITT:     return pgm_prewitt(src, dst);
+        case PGM_LEVEL_CANNY:       return pgm_canny(src, dst, 0, thresholds);
+        case PGM_LEVEL_CANNY_FIXED: return pgm_canny(src, dst, 1, thresholds);
+        case PGM_LEVEL_LBP:         return pgm_lbp(src, dst, LBP_MAP_RAW);
+    }
+    return PGM_ERR_ARGUMENT;
+}
+
+PgmStatus pgm_pyramid_apply(const PgmPyramid* pyr, PgmLevelOp op, int level, PgmPyramid* maps,
+                            const PgmCannyThresholds* thresholds) {
+    if (pyr == NULL || maps == NULL || pyr->levels < 1 || level >= pyr->levels) return PGM_ERR_ARGUMENT;
+    memset(maps, 0, sizeof(*maps));
+    maps->levels = pyr->levels;
+    for (int k = 0; k < pyr->levels; k++) {
+        if (level >= 0 && k != level) continue;
+        PgmStatus status = run_level_op(&pyr->level[k], &maps->level[k], op, thresholds);
+        if (status != PGM_OK) {
+            pgm_pyramid_free(maps);
+            return status;
+        }
+    }
+    return PGM_OK;
+}
+
+typedef struct {
+    const PgmPyramid* maps;
+    PGMImage* dst;
+} CombineJob;
+
+static void combine_job_rows(void* arg, int y0, int y1) {
+    const CombineJob* job = (const CombineJob*)arg;
+    int W = job->dst->width;
+    for (int y = y0; y < y1; y++) {
+        unsigned char* out = IMG_ROW(job->dst, y);
+        memcpy(out, IMG_ROW(&job->maps->level[0], y), W);
+        for (int k = 1; k < job->maps->levels; k++) {
+            const PGMImage* m = &job->maps->level[k];
+            if (m->pixels == NULL) continue;
+            const unsigned char* row = IMG_ROW(m, y >> k);
+            for (int x = 0; x < W; x++) {
+                unsigned char v = row[x >> k];
+                if (v > out[x]) out[x] = v;
+            }
+        }
+    }
+}
+
+PgmStatus pgm_pyramid_combine(const PgmPyramid* maps, PGMImage* dst) {
+    if (maps == NULL || maps->levels < 1 || !image_is_valid(&maps->level[0])) return PGM_ERR_ARGUMENT;
+    const PGMImage* base = &maps->level[0];
+    int allocated;
+    PgmStatus status = prepare_output(base, dst, base->width, base->height, 0, &allocated);
+    if (status != PGM_OK) return status;
+    CombineJob job = { maps, dst };
+    parallel_rows(0, base->height, parallel_grain(base->width, 1), combine_job_rows, &job);
+    return PGM_OK;
+}
+
+void pgm_pyramid_free(PgmPyramid* pyr) {
+    if (pyr == NULL) return;
+    for (int k = 0; k < PGM_MAX_PYRAMID_LEVELS; k++) free_image_memory(&pyr->level[k]);
+    pyr->levels = 0;
+}
+
+
+// Histogram Statistics and Point Operations
+// Pixels are only touched by the histogram pass; min, max, mean and variance come from
+// the 256 bins. A row chunk counts into four sub-histograms in turn, so runs of equal
+// pixels do not stall on the previous increment of the same counter, and adds its bins
+// to the shared 64-bit histogram once at the end.
+
+// adds pixels [0, n) of a row to the four sub-histograms
+static void histogram_add_row(const unsigned char* p, int n, uint32_t sub[4][256]) {
+    int j = 0;
+    for (; j + 4 <= n; j += 4) {
+        sub[0][p[j]]++;
+        sub[1][p[j + 1]]++;
+        sub[2][p[j + 2]]++;
+        sub[3][p[j + 3]]++;
+    }
+    for (; j < n; j++) sub[0][p[j]]++;
+}
+
+static void histogram_flush(uint32_t sub[4][256], uint64_t* hist) {
+    for (int v = 0; v < 256; v++) {
+        uint32_t n = sub[0][v] + sub[1][v] + sub[2][v] + sub[3][v];
+        if (n != 0) __atomic_fetch_add(&hist[v], n, __ATOMIC_RELAXED);
+    }
+}
+
+typedef struct {
+    const PGMImage* img;
+    uint64_t* hist;
+} HistogramJob;
+
+static void histogram_job_rows(void* arg, int y0, int y1) {
+    const HistogramJob* job = (const HistogramJob*)arg;
+    uint32_t sub[4][256];
+    memset(sub, 0, sizeof(sub));
+    for (int i = y0; i < y1; i++) histogram_add_row(IMG_ROW(job->img, i), job->img->width, sub);
+    histogram_flush(sub, job->hist);
+}
+
+// histogram of the whole image into hist (zeroed here)
+static void image_histogram(const PGMImage* img, uint64_t hist[256]) {
+    memset(hist, 0, 256 * sizeof(uint64_t));
+    HistogramJob job = { img, hist };
+    parallel_rows(0, img->height, parallel_grain(img->width, 16), histogram_job_rows, &job);
+}
+
+// smallest v >= first with at least percent of the pixels in [first, v];
+// 256 when there are no pixels from first up
+static int histogram_percentile(const uint64_t hist[256], int first, double percent) {
+    uint64_t total = 0;
+    for (int v = first; v < 256; v++) total += hist[v];
+    if (total == 0) return 256;
+    if (percent < 0) percent = 0;
+    if (percent > 100) percent = 100;
+    double target = percent / 100.0 * (double)total;
+    uint64_t sum = 0;
+    for (int v = first; v < 256; v++) {
+        sum += hist[v];
+        if (hist[v] != 0 && (double)sum >= target) return v;
+    }
+    return 255;
+}
+
+// Otsu threshold over the bins [first, 255]; 255 when they hold no pixels
+static int histogram_otsu(const uint64_t hist[256], int first) {
+    double total = 0, weighted = 0;
+    for (int v = first; v < 256; v++) {
+        total += (double)hist[v];
+        weighted += (double)v * hist[v];
+    }
+    if (total == 0) return 255;
+    double w0 = 0, sum0 = 0, best = -1;
+    int threshold = first;
+    for (int t = first; t < 255; t++) {
+        w0 += (double)hist[t];
+        sum0 += (double)t * hist[t];
+        double w1 = total - w0;
+        if (w0 == 0 || w1 == 0) continue;
+        double diff = sum0 / w0 - (weighted - sum0) / w1;
+        double between = w0 * w1 * diff * diff;
+        if (between > best) {
+            best = between;
+            threshold = t;
+        }
+    }
+    return threshold;
+}
+
+PgmStatus pgm_image_stats(const PGMImage* img, PgmStats* stats) {
+    if (!image_is_valid(img) || stats == NULL) return PGM_ERR_ARGUMENT;
+    image_histogram(img, stats->hist);
+    stats->count = (uint64_t)img->width * img->height;
+    stats->min = 0;
+    while (stats->hist[stats->min] == 0) stats->min++;
+    stats->max = 255;
+    while (stats->hist[stats->max] == 0) stats->max--;
+    double sum = 0, sum2 = 0;
+    for (int v = stats->min; v <= stats->max; v++) {
+        sum += (double)v * stats->hist[v];
+        sum2 += (double)v * v * stats->hist[v];
+    }
+    stats->mean = sum / (double)stats->count;
+    stats->variance = sum2 / (double)stats->count - stats->mean * stats->mean;
+    if (stats->variance < 0) stats->variance = 0;
+    return PGM_OK;
+}
+
+int pgm_stats_percentile(const PgmStats* stats, double percent) {
+    if (stats == NULL || stats->count == 0) return 0;
+    return histogram_percentile(stats->hist, 0, percent);
+}
+
+int pgm_stats_otsu(const PgmStats* stats) {
+    if (stats == NULL || stats->count == 0) return 0;
+    return histogram_otsu(stats->hist, 0);
+}
+
+typedef struct {
+    const PGMImage* src;
+    PGMImage* dst;
+    const unsigned char* lut;
+} LutJob;
+
+static void lut_job_rows(void* arg, int y0, int y1) {
+    const LutJob* job = (const LutJob*)arg;
+    const unsigned char* restrict lut = job->lut;
+    int W = job->src->width;
+    for (int i = y0; i < y1; i++) {
+        const unsigned char* restrict in = IMG_ROW(job->src, i);
+        unsigned char* restrict out = IMG_ROW(job->dst, i);
+        for (int j = 0; j < W; j++) out[j] = lut[in[j]];
+    }
+}
+
+PgmStatus pgm_apply_lut(const PGMImage* src, PGMImage* dst, const unsigned char lut[256]) {
+    if (!image_is_valid(src) || lut == NULL) return PGM_ERR_ARGUMENT;
+    int allocated;
+    PgmStatus status = prepare_output(src, dst, src->width, src->height, 0, &allocated);
+    if (status != PGM_OK) return status;
+    LutJob job = { src, dst, lut };
+    parallel_rows(0, src->height, parallel_grain(src->width, 1), lut_job_rows, &job);
+    // a table that goes beyond max_val raises it, the file stays valid
+    for (int v = 0; v < 256; v++) {
+        if (lut[v] > dst->max_val) dst->max_val = lut[v];
+    }
+    return PGM_OK;
+}
+
+PgmStatus pgm_lut_stretch(const PgmStats* stats, double low_pct, double high_pct, int max_val,
+                          unsigned char lut[256]) {
+    if (stats == NULL || stats->count == 0 || lut == NULL || max_val < 1 || max_val > 255 ||
+        !(low_pct >= 0 && low_pct <= high_pct && high_pct <= 100)) {
+        return PGM_ERR_ARGUMENT;
+    }
+    int lo = pgm_stats_percentile(stats, low_pct);
+    int hi = pgm_stats_percentile(stats, high_pct);
+    for (int v = 0; v < 256; v++) {
+        if (hi <= lo) lut[v] = (unsigned char)(v < max_val ? v : max_val);  // nothing to stretch
+        else if (v <= lo) lut[v] = 0;
+        else if (v >= hi) lut[v] = (unsigned char)max_val;
+        else lut[v] = (unsigned char)(((v - lo) * max_val * 2 + (hi - lo)) / (2 * (hi - lo)));
+    }
+    return PGM_OK;
+}
+
+PgmStatus pgm_lut_equalize(const PgmStats* stats, int max_val, unsigned char lut[256]) {
+    if (stats == NULL || stats->count == 0 || lut == NULL || max_val < 1 || max_val > 255) {
+        return PGM_ERR_ARGUMENT;
+    }
+    // the darkest value maps to 0, the cumulative count of the others is spread linearly
+    uint64_t first = stats->hist[stats->min];
+    uint64_t range = stats->count - first;
+    uint64_t cdf = 0;
+    for (int v = 0; v < 256; v++) {
+        cdf += stats->hist[v];
+        if (range == 0) lut[v] = (unsigned char)(v < max_val ? v : max_val);  // one value only
+        else if (cdf <= first) lut[v] = 0;
+        else lut[v] = (unsigned char)(((cdf - first) * (uint64_t)max_val * 2 + range) / (2 * range));
+    }
+    return PGM_OK;
+}
+
+PgmStatus pgm_lut_gamma(double gamma, int max_val, unsigned char lut[256]) {
+    if (!(gamma > 0) || lut == NULL || max_val < 1 || max_val > 255) return PGM_ERR_ARGUMENT;
+    for (int v = 0; v < 256; v++) {
+        double x = v < max_val ? (double)v / max_val : 1.0;
+        lut[v] = (unsigned char)lround(max_val * pow(x, gamma));
+    }
+    return PGM_OK;
+}
+
+
+// Apply Filters
+
+typedef struct {
+    const PGMImage* src;
+    PGMImage* dst;
+    StencilRowFn fn;
+} StencilJob;
+
+static void stencil_rows(void* arg, int y0, int y1) {
+    const StencilJob* job = (const StencilJob*)arg;
+    for (int i = y0; i < y1; i++) {
+        const unsigned char* rows[3] = { IMG_ROW(job->src, i - 1), IMG_ROW(job->src, i), IMG_ROW(job->src, i + 1) };
+        job->fn(rows, IMG_ROW(job->dst, i), 1, job->src->width - 1);
+    }
+}
+
+// runs a 3x3 row kernel over rows 1 .. H-2 on the worker pool
+// copy_src keeps the source pixels in the one pixel frame, else it is zero
+static PgmStatus run_stencil(const PGMImage* src, PGMImage* dst, StencilRowFn fn, int copy_src) {
+    int allocated;
+    PgmStatus status = prepare_output(src, dst, src->width, src->height, copy_src, &allocated);
+    if (status != PGM_OK) return status;
+    StencilJob job = { src, dst, fn };
+    parallel_rows(1, src->height - 1, parallel_grain(src->width, 1), stencil_rows, &job);
+    return PGM_OK;
+}
+
+// Convolution
+// A kernel is turned into a plan once per call: integer weights whose sums fit 32 bits
+// are summed exactly in int32, anything else in float. A rank-1 kernel (every row a
+// multiple of one row) runs as a horizontal pass into a ring of kh rows per band and a
+// vertical pass over that ring, kw + kh multiplies per pixel instead of kw * kh. Other
+// kernels accumulate one horizontal pass per non-zero kernel row. Rows whose taps are
+// mirror images (or negated mirror images) add (or subtract) the two pixels first and
+// multiply once. The 3, 5 and 7 tap passes are separate unrolled functions.
+// The Sobel, Prewitt and 3x3 mean kernels are recognized and run on the SIMD stencils.
+
+// out[x] (+)= sum_l taps[l] * s[x - r + l] for x0 <= x < x1 with n = 2r + 1 taps;
+// sym 1 / -1 folds symmetric / antisymmetric taps (an antisymmetric center tap is 0).
+// Every (sym, add) case is its own loop so the compiler can vectorize it.
+#define CONV_ROW_LOOP(T, TERM, STORE)                                                              \
+    for (int x = x0; x < x1; x++) {                                                                \
+        const unsigned char* p = s + x - r;                                                        \
+        T v = taps[r] * (T)p[r];                                                                   \
+        for (int l = 0; l < r; l++) v += TERM;                                                     \
+        STORE;                                                                                     \
+    }
+#define CONV_ROW_CASES(T, TERM)                                                                    \
+    if (add) { CONV_ROW_LOOP(T, TERM, out[x] += v) } else { CONV_ROW_LOOP(T, TERM, out[x] = v) }
+#define DEFINE_CONV_ROW(NAME, T)                                                                   \
+    static inline __attribute__((always_inline)) void NAME##_body(                                 \
+        const unsigned char* restrict s, const T* restrict taps, int n, int sym, T* restrict out, \
+        int x0, int x1, int add) {                                                                 \
+        int r = n / 2;                                                                             \
+        if (sym > 0) {                                                                             \
+            CONV_ROW_CASES(T, taps[l] * (T)(p[l] + p[n - 1 - l]))                                  \
+        } else if (sym < 0) {                                                                      \
+            CONV_ROW_CASES(T, taps[l] * (T)(p[l] - p[n - 1 - l]))                                  \
+        } else {                                                                                   \
+            CONV_ROW_CASES(T, taps[l] * (T)p[l] + taps[n - 1 - l] * (T)p[n - 1 - l])               \
+        }                                                                                          \
+    }
+
+// out[x] = sum_i taps[i] * rows[i][x], the vertical pass of a separable kernel
+#define CONV_COL_LOOP(T, TERM)                                                                     \
+    for (int x = x0; x < x1; x++) {                                                                \
+        T v = taps[r] * rows[r][x];                                                                \
+        for (int i = 0; i < r; i++) v += TERM;                                                     \
+        out[x] = v;                                                                                \
+    }
+#define DEFINE_CONV_COL(NAME, T)                                                                   \
+    static inline __attribute__((always_inline)) void NAME##_body(                                 \
+        const T* const* rows, const T* restrict taps, int n, int sym, T* restrict out, int x0, int x1) { \
+        int r = n / 2;                                                                             \
+        if (sym > 0) {                                                                             \
+            CONV_COL_LOOP(T, taps[i] * (rows[i][x] + rows[n - 1 - i][x]))                          \
+        } else if (sym < 0) {                                                                      \
+            CONV_COL_LOOP(T, taps[i] * (rows[i][x] - rows[n - 1 - i][x]))                          \
+        } else {                                                                                   \
+            CONV_COL_LOOP(T, taps[i] * rows[i][x] + taps[n - 1 - i] * rows[n - 1 - i][x])          \
+        }                                                                                          \
+    }
+
+// out[x] = the whole n x n window in one pass, for kernels symmetric about both axes
+// (blurs): every tap of the top-left quadrant weighs up to four mirrored pixels
+#define DEFINE_CONV_QUAD(NAME, T)                                                                  \
+    static inline __attribute__((always_inline)) void NAME##_body(                                 \
+        const unsigned char* const* rows, const T* restrict taps, int n, T* restrict out, int x0, int x1) { \
+        int r = n / 2;                                                                             \
+        const unsigned char* row[PGM_MAX_KERNEL_SIZE];                                             \
+        for (int i = 0; i < n; i++) row[i] = rows[i] - r;                                          \
+        for (int x = x0; x < x1; x++) {                                                            \
+            const unsigned char* c = row[r] + x;                                                   \
+            T v = taps[r * n + r] * (T)c[r];                                                       \
+            for (int l = 0; l < r; l++) v += taps[r * n + l] * (T)(c[l] + c[n - 1 - l]);           \
+            for (int i = 0; i < r; i++) {                                                          \
+                const unsigned char* a = row[i] + x;                                               \
+                const unsigned char* b = row[n - 1 - i] + x;                                       \
+                v += taps[i * n + r] * (T)(a[r] + b[r]);                                           \
+                for (int l = 0; l < r; l++) {                                                      \
+                    v += taps[i * n + l] * (T)(a[l] + a[n - 1 - l] + b[l] + b[n - 1 - l]);         \
+                }                                                                                  \
+            }                                                                                      \
+            out[x] = v;                                                                            \
+        }                                                                                          \
+    }
+
+DEFINE_CONV_ROW(conv_row_int, int32_t)
+DEFINE_CONV_ROW(conv_row_float, float)
+DEFINE_CONV_COL(conv_col_int, int32_t)
+DEFINE_CONV_COL(conv_col_float, float)
+DEFINE_CONV_QUAD(conv_quad_int, int32_t)
+DEFINE_CONV_QUAD(conv_quad_float, float)
+
+// entry points with the tap count fixed at compile time (N) or taken from n (0);
+// one set per instruction set level, the bodies are compiled for each target
+#define DEFINE_CONV_ENTRY(NAME, T, N, SUFFIX, ATTR)                                                \
+    ATTR static void NAME##_##N##SUFFIX(const unsigned char* s, const void* taps, int n, int sym, \
+                                        void* out, int x0, int x1, int add) {                      \
+        NAME##_body(s, (const T*)taps, N ? N : n, sym, (T*)out, x0, x1, add);                      \
+    }
+#define DEFINE_CONV_COL_ENTRY(NAME, T, N, SUFFIX, ATTR)                                            \
+    ATTR static void NAME##_##N##SUFFIX(const void* const* rows, const void* taps, int n, int sym, \
+                                        void* out, int x0, int x1) {                               \
+        NAME##_body((const T* const*)rows, (const T*)taps, N ? N : n, sym, (T*)out, x0, x1);       \
+    }
+#define DEFINE_CONV_QUAD_ENTRY(NAME, T, N, SUFFIX, ATTR)                                           \
+    ATTR static void NAME##_##N##SUFFIX(const unsigned char* const* rows, const void* taps, int n, \
+                                        void* out, int x0, int x1) {                               \
+        NAME##_body(rows, (const T*)taps, N ? N : n, (T*)out, x0, x1);                             \
+    }
+#define DEFINE_CONV_SIZES(KIND, NAME, T, SUFFIX, ATTR)                                             \
+    KIND(NAME, T, 0, SUFFIX, ATTR) KIND(NAME, T, 3, SUFFIX, ATTR)                                  \
+    KIND(NAME, T, 5, SUFFIX, ATTR) KIND(NAME, T, 7, SUFFIX, ATTR)
+#define CONV_SIZES(NAME, SUFFIX) { NAME##_0##SUFFIX, NAME##_3##SUFFIX, NAME##_5##SUFFIX, NAME##_7##SUFFIX }
+#define DEFINE_CONV_KERNEL_SET(SET, SUFFIX, ATTR)                                                  \
+    DEFINE_CONV_SIZES(DEFINE_CONV_ENTRY, conv_row_float, float, SUFFIX, ATTR)                      \
+    DEFINE_CONV_SIZES(DEFINE_CONV_ENTRY, conv_row_int, int32_t, SUFFIX, ATTR)                      \
+    DEFINE_CONV_SIZES(DEFINE_CONV_COL_ENTRY, conv_col_float, float, SUFFIX, ATTR)                  \
+    DEFINE_CONV_SIZES(DEFINE_CONV_COL_ENTRY, conv_col_int, int32_t, SUFFIX, ATTR)                  \
+    DEFINE_CONV_SIZES(DEFINE_CONV_QUAD_ENTRY, conv_quad_float, float, SUFFIX, ATTR)                \
+    DEFINE_CONV_SIZES(DEFINE_CONV_QUAD_ENTRY, conv_quad_int, int32_t, SUFFIX, ATTR)                \
+    static const ConvKernelSet SET = {                                                             \
+        { CONV_SIZES(conv_row_float, SUFFIX), CONV_SIZES(conv_row_int, SUFFIX) },                  \
+        { CONV_SIZES(conv_col_float, SUFFIX), CONV_SIZES(conv_col_int, SUFFIX) },                  \
+        { CONV_SIZES(conv_quad_float, SUFFIX), CONV_SIZES(conv_quad_int, SUFFIX) } };
+
+DEFINE_CONV_KERNEL_SET(conv_kernels_scalar, _scalar, )
+
+typedef struct {
+    int kw, kh, rx, ry;
+    int integer;          // int32 taps and sums, else float
+    int separable;        // taps row 0 is the horizontal, col the vertical factor
+    int int_norm;         // divisor and bias are integers: exact integer rounding
+    int32_t sign;                    // -1 when the divisor was negative
+    int32_t divisor, offset, bias;   // int_norm: floor((sign * sum + offset) / divisor) + bias
+    int shift;                       // log2(divisor) for a power of two, else -1
+    double inv_divisor;
+    float scale, fbias;              // not int_norm: floor(sum * scale + fbias)
+    int row_size, col_size;  // ConvKernelSet index of the tap counts
+    int quad;                // square 2-D kernel symmetric about both axes, one pass
+    int col_sym;
+    signed char row_sym[PGM_MAX_KERNEL_SIZE];  // per kernel row (separable: row 0 only)
+    unsigned char row_zero[PGM_MAX_KERNEL_SIZE];
+    int32_t itaps[PGM_MAX_KERNEL_SIZE * PGM_MAX_KERNEL_SIZE];
+    float ftaps[PGM_MAX_KERNEL_SIZE * PGM_MAX_KERNEL_SIZE];
+    int32_t icol[PGM_MAX_KERNEL_SIZE];
+    float fcol[PGM_MAX_KERNEL_SIZE];
+} ConvPlan;
+
+static int kernel_is_valid(const PgmKernel* k) {
+    if (k == NULL || k->width < 1 || k->height < 1 || k->width > PGM_MAX_KERNEL_SIZE ||
+        k->height > PGM_MAX_KERNEL_SIZE || k->width % 2 == 0 || k->height % 2 == 0 ||
+        !(k->divisor != 0) || !isfinite(k->divisor) || !isfinite(k->bias)) {
+        return 0;
+    }
+    for (int i = 0; i < k->width * k->height; i++) {
+        if (!isfinite(k->weights[i])) return 0;
+    }
+    return 1;
+}
+
+// 1 symmetric, -1 antisymmetric, 0 neither
+static int taps_symmetry(const float* t, int n) {
+    int sym = 1, anti = t[n / 2] == 0;
+    for (int l = 0; l < n / 2; l++) {
+        if (t[l] != t[n - 1 - l]) sym = 0;
+        if (t[l] != -t[n - 1 - l]) anti = 0;
+    }
+    return sym ? 1 : (anti ? -1 : 0);
+}
+
+static int is_integral(float v) {
+    return v == floorf(v) && fabsf(v) <= (float)(1 << 30);
+}
+
+static int64_t gcd64(int64_t a, int64_t b) {
+    while (b != 0) { int64_t t = a % b; a = b; b = t; }
+    return a < 0 ? -a : a;
+}
+
+// splits the kernel into col[i] * row[j]; integer kernels only with integer factors,
+// so the two passes give exactly the 2-D sums. Returns 0 when the kernel has rank > 1.
+static int factor_kernel(const PgmKernel* k, int integer, float* row, float* col) {
+    int w = k->width, h = k->height, pi = 0, pj = 0;
+    for (int i = 0; i < w * h; i++) {
+        if (fabsf(k->weights[i]) > fabsf(k->weights[pi * w + pj])) { pi = i / w; pj = i % w; }
+    }
+    float pivot = k->weights[pi * w + pj];
+    if (pivot == 0) return 0;
+    if (integer) {
+        int64_t g = 0;
+        for (int j = 0; j < w; j++) g = gcd64(g, (int64_t)k->weights[pi * w + j]);
+        if (pivot < 0) g = -g;
+        for (int j = 0; j < w; j++) row[j] = (float)((int64_t)k->weights[pi * w + j] / g);
+        for (int i = 0; i < h; i++) {
+            int64_t c = (int64_t)k->weights[i * w + pj];
+            if (c % (int64_t)row[pj] != 0) return 0;
+            col[i] = (float)(c / (int64_t)row[pj]);
+        }
+        for (int i = 0; i < h; i++) {
+            for (int j = 0; j < w; j++) {
+                if ((int64_t)col[i] * (int64_t)row[j] != (int64_t)k->weights[i * w + j]) return 0;
+            }
+        }
+        return 1;
+    }
+    for (int j = 0; j < w; j++) row[j] = k->weights[pi * w + j] / pivot;
+    for (int i = 0; i < h; i++) col[i] = k->weights[i * w + pj];
+    float tolerance = 1e-6f * fabsf(pivot);
+    for (int i = 0; i < h; i++) {
+        for (int j = 0; j < w; j++) {
+            if (fabsf(col[i] * row[j] - k->weights[i * w + j]) > tolerance) return 0;
+        }
+    }
+    return 1;
+}
+
+// ConvKernelSet index of an n tap pass: the unrolled 3, 5 and 7 tap versions or the generic one
+static int conv_size_index(int n) {
+    return n == 3 ? 1 : (n == 5 ? 2 : (n == 7 ? 3 : 0));
+}
+
+// mirror symmetric left-right and top-bottom
+static int kernel_quad_symmetric(const PgmKernel* k) {
+    int n = k->width;
+    if (k->height != n) return 0;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            float v = k->weights[i * n + j];
+            if (v != k->weights[i * n + n - 1 - j] || v != k->weights[(n - 1 - i) * n + j]) return 0;
+        }
+    }
+    return 1;
+}
+
+static void build_conv_plan(const PgmKernel* k, int allow_separable, ConvPlan* p) {
+    int w = k->width, h = k->height;
+    memset(p, 0, offsetof(ConvPlan, itaps));
+    p->kw = w;
+    p->kh = h;
+    p->rx = w / 2;
+    p->ry = h / 2;
+    // integer sums when every weight is an integer and no sum (plus the rounding
+    // offset) can leave int32
+    double abs_sum = 0;
+    p->integer = 1;
+    for (int i = 0; i < w * h; i++) {
+        if (!is_integral(k->weights[i])) p->integer = 0;
+        abs_sum += fabs(k->weights[i]);
+    }
+    if (abs_sum * 255 > (double)(1 << 30)) p->integer = 0;
+
+    float row[PGM_MAX_KERNEL_SIZE] = {0}, col[PGM_MAX_KERNEL_SIZE] = {0};
+    p->separable = allow_separable && w > 1 && h > 1 && factor_kernel(k, p->integer, row, col);
+    const float* taps = p->separable ? row : k->weights;
+    int taps_rows = p->separable ? 1 : h;
+    for (int i = 0; i < taps_rows; i++) {
+        int zero = 1;
+        for (int j = 0; j < w; j++) {
+            p->itaps[i * w + j] = (int32_t)taps[i * w + j];
+            p->ftaps[i * w + j] = taps[i * w + j];
+            if (taps[i * w + j] != 0) zero = 0;
+        }
+        p->row_sym[i] = (signed char)taps_symmetry(taps + i * w, w);
+        p->row_zero[i] = (unsigned char)zero;
+    }
+    if (p->separable) {
+        for (int i = 0; i < h; i++) {
+            p->icol[i] = (int32_t)col[i];
+            p->fcol[i] = col[i];
+        }
+        p->col_sym = taps_symmetry(col, h);
+        p->col_size = conv_size_index(h);
+    }
+    p->row_size = conv_size_index(w);
+    p->quad = !p->separable && w > 1 && kernel_quad_symmetric(k);
+
+    p->int_norm = p->integer && is_integral(k->divisor) && is_integral(k->bias);
+    if (p->int_norm) {
+        p->sign = k->divisor < 0 ? -1 : 1;
+        p->divisor = (int32_t)fabsf(k->divisor);
+        p->offset = k->round_down ? 0 : p->divisor / 2;
+        p->bias = (int32_t)k->bias;
+        p->shift = -1;
+        for (int b = 0; b < 31; b++) {
+            if (p->divisor == (int32_t)1 << b) p->shift = b;
+        }
+        p->inv_divisor = 1.0 / p->divisor;
+    } else {
+        p->scale = 1.0f / k->divisor;
+        p->fbias = k->bias + (k->round_down ? 0.0f : 0.5f);
+    }
+}
+
+// taps of kernel row i (row 0 is the horizontal factor of a separable plan)
+static const void* plan_taps(const ConvPlan* p, int i) {
+    return p->integer ? (const void*)(p->itaps + i * p->kw) : (const void*)(p->ftaps + i * p->kw);
+}
+
+// rows[i] = source row y - ry + i; acc gets the raw sums of the 2-D (non-separable) plan
+static void conv_accumulate_row(const ConvPlan* p, const unsigned char* const* rows, void* acc, int x0, int x1) {
+    const ConvKernelSet* ks = stencil_kernels.conv;
+    if (p->quad) {
+        ks->quad[p->integer][p->row_size](rows, plan_taps(p, 0), p->kw, acc, x0, x1);
+        return;
+    }
+    int add = 0;
+    for (int i = 0; i < p->kh; i++) {
+        if (p->row_zero[i]) continue;
+        ks->row[p->integer][p->row_size](rows[i], plan_taps(p, i), p->kw, p->row_sym[i], acc, x0, x1, add);
+        add = 1;
+    }
+    if (!add) memset((int32_t*)acc + x0, 0, (size_t)(x1 - x0) * sizeof(int32_t));
+}
+
+// divided, offset and rounded sums (not clamped yet)
+static void conv_normalize(const ConvPlan* p, const void* acc, int32_t* vals, int x0, int x1) {
+    if (p->int_norm) {
+        const int32_t* a = (const int32_t*)acc;
+        int32_t sign = p->sign, offset = p->offset, d = p->divisor, bias = p->bias;
+        if (p->shift >= 0) {
+            // >> of a negative int is an arithmetic shift (floor) with GCC and Clang
+            for (int x = x0; x < x1; x++) vals[x] = ((sign * a[x] + offset) >> p->shift) + bias;
+            return;
+        }
+        // floor division through the reciprocal, corrected by one where it rounded wrong
+        for (int x = x0; x < x1; x++) {
+            int32_t n = sign * a[x] + offset;
+            int32_t q = (int32_t)floor(n * p->inv_divisor);
+            int32_t r = n - q * d;
+            vals[x] = q + (r >= d) - (r < 0) + bias;
+        }
+        return;
+    }
+    for (int x = x0; x < x1; x++) {
+        float sum = p->integer ? (float)((const int32_t*)acc)[x] : ((const float*)acc)[x];
+        float v = floorf(sum * p->scale + p->fbias);
+        vals[x] = v < -65536.0f ? -65536 : (v > 65536.0f ? 65536 : (int32_t)v);
+    }
+}
+
+typedef struct {
+    const PGMImage* src;
+    PGMImage* dst;
+    const ConvPlan* plan[2];  // the second one only for a gradient
+    int nplans;
+    int failed;
+} ConvJob;
+
+static void conv_job_rows(void* arg, int y0, int y1) {
+    ConvJob* job = (ConvJob*)arg;
+    int W = job->src->width;
+    int x0 = job->plan[0]->rx, x1 = W - job->plan[0]->rx;
+    // per plan: a ring of kh horizontal rows when separable, the sums and the values
+    size_t words = 0;
+    for (int k = 0; k < job->nplans; k++) words += (size_t)W * ((job->plan[k]->separable ? job->plan[k]->kh : 0) + 2);
+    int32_t* block = (int32_t*)buffer_pool_get(words * sizeof(int32_t), 0);
+    if (block == NULL) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    int32_t* ring[2] = { NULL, NULL };
+    int32_t* acc[2];
+    int32_t* vals[2];
+    int tag[2][PGM_MAX_KERNEL_SIZE];
+    int32_t* next = block;
+    for (int k = 0; k < job->nplans; k++) {
+        if (job->plan[k]->separable) {
+            ring[k] = next;
+            next += (size_t)W * job->plan[k]->kh;
+        }
+        acc[k] = next;
+        vals[k] = next + W;
+        next += 2 * (size_t)W;
+        for (int i = 0; i < PGM_MAX_KERNEL_SIZE; i++) tag[k][i] = -1;
+    }
+    const ConvKernelSet* ks = stencil_kernels.conv;
+    for (int y = y0; y < y1; y++) {
+        for (int k = 0; k < job->nplans; k++) {
+            const ConvPlan* p = job->plan[k];
+            const unsigned char* rows[PGM_MAX_KERNEL_SIZE];
+            for (int i = 0; i < p->kh; i++) rows[i] = IMG_ROW(job->src, y - p->ry + i);
+            if (p->separable) {
+                // source row r is filtered once per band into slot r % kh
+                const void* hrows[PGM_MAX_KERNEL_SIZE];
+                for (int i = 0; i < p->kh; i++) {
+                    int r = y - p->ry + i, slot = r % p->kh;
+                    int32_t* h = ring[k] + (size_t)slot * W;
+                    if (tag[k][slot] != r) {
+                        ks->row[p->integer][p->row_size](rows[i], plan_taps(p, 0), p->kw, p->row_sym[0], h, x0, x1, 0);
+                        tag[k][slot] = r;
+                    }
+                    hrows[i] = h;
+                }
+                ks->col[p->integer][p->col_size](hrows, p->integer ? (const void*)p->icol : (const void*)p->fcol, p->kh, p->col_sym,
+                          acc[k], x0, x1);
+            } else {
+                conv_accumulate_row(p, rows, acc[k], x0, x1);
+            }
+            conv_normalize(p, acc[k], vals[k], x0, x1);
+        }
+        unsigned char* out = IMG_ROW(job->dst, y);
+        if (job->nplans == 1) {
+            for (int x = x0; x < x1; x++) {
+                int32_t v = vals[0][x];
+                out[x] = (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+            }
+        } else {
+            for (int x = x0; x < x1; x++) {
+                int32_t v = abs(vals[0][x]) + abs(vals[1][x]);
+                out[x] = (unsigned char)(v > 255 ? 255 : v);
+            }
+        }
+    }
+    buffer_pool_put(block);
+}
+
+// runs one plan (or a gradient pair of the same size) over the pixels the kernel covers
+static PgmStatus run_conv(const PGMImage* src, PGMImage* dst, const ConvPlan* a, const ConvPlan* b) {
+    int allocated;
+    PgmStatus status = prepare_output(src, dst, src->width, src->height, b == NULL, &allocated);
+    if (status != PGM_OK) return status;
+    int y0 = a->ry, y1 = src->height - a->ry;
+    if (y1 <= y0 || src->width <= 2 * a->rx) return PGM_OK;
+    ConvJob job = { src, dst, { a, b }, b == NULL ? 1 : 2, 0 };
+    parallel_rows(y0, y1, parallel_grain(src->width, a->kh), conv_job_rows, &job);
+    return job.failed ? fail_output(dst, allocated, PGM_ERR_NOMEM) : PGM_OK;
+}
+
+// the operators of this file, as kernels; they are recognized and sent to the stencils
+static const PgmKernel mean3_kernel = { 3, 3, 9, 0, 1, { 1, 1, 1, 1, 1, 1, 1, 1, 1 } };
+static const PgmKernel sobel_x_kernel = { 3, 3, 1, 0, 0, { -1, 0, 1, -2, 0, 2, -1, 0, 1 } };
+static const PgmKernel sobel_y_kernel = { 3, 3, 1, 0, 0, { -1, -2, -1, 0, 0, 0, 1, 2, 1 } };
+static const PgmKernel prewitt_x_kernel = { 3, 3, 1, 0, 0, { -1, 0, 1, -1, 0, 1, -1, 0, 1 } };
+static const PgmKernel prewitt_y_kernel = { 3, 3, 1, 0, 0, { -1, -1, -1, 0, 0, 0, 1, 1, 1 } };
+
+static int kernel_equals(const PgmKernel* a, const PgmKernel* b) {
+    return a->width == b->width && a->height == b->height && a->divisor == b->divisor && a->bias == b->bias &&
+           a->round_down == b->round_down &&
+           memcmp(a->weights, b->weights, (size_t)a->width * a->height * sizeof(float)) == 0;
+}
+
+PgmStatus pgm_kernel_init(PgmKernel* kernel, int width, int height, const float* weights) {
+    if (kernel == NULL || weights == NULL) return PGM_ERR_ARGUMENT;
+    memset(kernel, 0, sizeof(*kernel));
+    kernel->width = width;
+    kernel->height = height;
+    kernel->divisor = 1;
+    if (width < 1 || height < 1 || width > PGM_MAX_KERNEL_SIZE || height > PGM_MAX_KERNEL_SIZE) {
+        return PGM_ERR_DIMENSIONS;
+    }
+    float sum = 0;
+    for (int i = 0; i < width * height; i++) {
+        kernel->weights[i] = weights[i];
+        sum += weights[i];
+    }
+    if (sum != 0) kernel->divisor = sum;
+    return kernel_is_valid(kernel) ? PGM_OK : PGM_ERR_DIMENSIONS;
+}
+
+PgmStatus pgm_kernel_parse(const char* text, PgmKernel* kernel) {
+    if (text == NULL || kernel == NULL) return PGM_ERR_ARGUMENT;
+    float weights[PGM_MAX_KERNEL_SIZE * PGM_MAX_KERNEL_SIZE];
+    int width = 0, height = 0, cols = 0, count = 0;
+    float divisor = 0, bias = 0;
+    int has_divisor = 0;
+    const char* p = text;
+    for (;;) {
+        char c = *p;
+        if (c == '#') {
+            while (*p != '\0' && *p != '\n') p++;
+            continue;
+        }
+        if (c == '\0' || c == '\n' || c == ';') {
+            // end of a kernel row, blank lines are skipped
+            if (cols > 0) {
+                if (width == 0) width = cols;
+                else if (cols != width) return PGM_ERR_FORMAT;
+                height++;
+                cols = 0;
+            }
+            if (c == '\0') break;
+            p++;
+            continue;
+        }
+        if (c == ',' || isspace((unsigned char)c)) {
+            p++;
+            continue;
+        }
+        char* end;
+        if (c == '/' || strncmp(p, "divisor", 7) == 0 || strncmp(p, "bias", 4) == 0) {
+            int is_bias = c == 'b';
+            p += c == '/' ? 1 : (is_bias ? 4 : 7);
+            float v = strtof(p, &end);
+            if (end == p) return PGM_ERR_FORMAT;
+            if (is_bias) bias = v;
+            else { divisor = v; has_divisor = 1; }
+            p = end;
+            continue;
+        }
+        float v = strtof(p, &end);
+        if (end == p) return PGM_ERR_FORMAT;
+        if (count == PGM_MAX_KERNEL_SIZE * PGM_MAX_KERNEL_SIZE || cols == PGM_MAX_KERNEL_SIZE) {
+            return PGM_ERR_DIMENSIONS;
+        }
+        weights[count++] = v;
+        cols++;
+        p = end;
+    }
+    if (count == 0) return PGM_ERR_FORMAT;
+    PgmStatus status = pgm_kernel_init(kernel, width, height, weights);
+    if (status != PGM_OK) return status;
+    if (has_divisor) kernel->divisor = divisor;
+    kernel->bias = bias;
+    return kernel_is_valid(kernel) ? PGM_OK : PGM_ERR_FORMAT;
+}
+
+// kernel files are small text files, anything past 1 MB is not a kernel
+PgmStatus pgm_kernel_load(const char* path, PgmKernel* kernel) {
+    if (path == NULL || kernel == NULL) return PGM_ERR_ARGUMENT;
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) return PGM_ERR_IO;
+    size_t cap = 1 << 20;
+    char* text = (char*)pgm_malloc(cap + 1);
+    if (text == NULL) {
+        fclose(fp);
+        return PGM_ERR_NOMEM;
+    }
+    size_t len = fread(text, 1, cap + 1, fp);
+    int failed = ferror(fp);
+    fclose(fp);
+    PgmStatus status = failed ? PGM_ERR_IO : (len > cap ? PGM_ERR_FORMAT : PGM_OK);
+    if (status == PGM_OK) {
+        text[len] = '\0';
+        status = pgm_kernel_parse(text, kernel);
+    }
+    pgm_free(text);
+    return status;
+}
+
+static PgmStatus convolve_framed(const PGMImage* src, PGMImage* dst, const PgmKernel* kernel) {
+    if (kernel_equals(kernel, &mean3_kernel)) return run_stencil(src, dst, stencil_kernels.average, 1);
+    ConvPlan plan;
+    build_conv_plan(kernel, 1, &plan);
+    return run_conv(src, dst, &plan, NULL);
+}
+
+static PgmStatus gradient_framed(const PGMImage* src, PGMImage* dst, const PgmKernel* kx, const PgmKernel* ky) {
+    if (kernel_equals(kx, &sobel_x_kernel) && kernel_equals(ky, &sobel_y_kernel)) {
+        return run_stencil(src, dst, stencil_kernels.sobel, 0);
+    }
+    if (kernel_equals(kx, &prewitt_x_kernel) && kernel_equals(ky, &prewitt_y_kernel)) {
+        return run_stencil(src, dst, stencil_kernels.prewitt, 0);
+    }
+    ConvPlan plan_x, plan_y;
+    build_conv_plan(kx, 0, &plan_x);
+    build_conv_plan(ky, 0, &plan_y);
+    return run_conv(src, dst, &plan_x, &plan_y);
+}
+
+PgmStatus pgm_convolve(const PGMImage* src, PGMImage* dst, const PgmKernel* kernel) {
+    if (!image_is_valid(src) || !kernel_is_valid(kernel)) return PGM_ERR_ARGUMENT;
+    FramedOp op = { FRAMED_CONVOLVE, 0, { kernel, NULL }, NULL, 0, { 0, 0 }, NULL };
+    return run_bordered(src, dst, &op);
+}
+
+PgmStatus pgm_convolve_gradient(const PGMImage* src, PGMImage* dst, const PgmKernel* kx, const PgmKernel* ky) {
+    if (!image_is_valid(src) || !kernel_is_valid(kx) || !kernel_is_valid(ky) ||
+        kx->width != ky->width || kx->height != ky->height) {
+        return PGM_ERR_ARGUMENT;
+    }
+    FramedOp op = { FRAMED_GRADIENT, 0, { kx, ky }, NULL, 0, { 0, 0 }, NULL };
+    return run_bordered(src, dst, &op);
+}
+
+// scalar reference, computes out[j] for j0 <= j < j1 from rows i-1, i, i+1
+void average_row_scalar(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {
+    for (int j = j0; j < j1; j++) {
+        long sum = 0;
+        for (int k = -1; k <= 1; k++) {
+            for (int l = -1; l <= 1; l++) {
+                sum += rows[k + 1][j + l];
+            }
+        }
+        out[j] = (unsigned char)(sum / 9);
+    }
+}
+
+static PgmStatus average_filter(const PGMImage* original, PGMImage* new_img) {
+    return convolve_framed(original, new_img, &mean3_kernel);
+}
+
+// Mean of a (2r+1)x(2r+1) window in O(1) per pixel with separable running sums:
+// column sums over the 2r+1 rows slide down one row per output row, and the
+// window sum slides right over those column sums. The division by n = (2r+1)^2
+// is a multiply by 2^40 / n rounded up and a shift, which gives exactly
+// sum / n (integer division) for every sum up to 255 * n, so radius 1 matches
+// average_filter. Pixels closer than r to the border keep their value.
+// Row bands run in parallel, each band primes its own column sums from the 2r rows
+// above its first output row.
+typedef struct {
+    const PGMImage* src;
+    PGMImage* dst;
+    int r;
+    uint64_t recip;
+    int failed;
+} BoxJob;
+
+static void box_filter_rows(void* arg, int y0, int y1) {
+    BoxJob* job = (BoxJob*)arg;
+    const PGMImage* original = job->src;
+    int W = original->width;
+    int r = job->r;
+    const int n = 2 * r + 1;
+
+    uint32_t* colsum = (uint32_t*)buffer_pool_get((size_t)W * sizeof(uint32_t), 1);
+    if (colsum == NULL) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    for (int y = y0 - r; y < y0 + r; y++) {
+        const unsigned char* src = IMG_ROW(original, y);
+        for (int c = 0; c < W; c++) colsum[c] += src[c];
+    }
+
+    for (int i = y0; i < y1; i++) {
+        const unsigned char* add = IMG_ROW(original, i + r);
+        for (int c = 0; c < W; c++) colsum[c] += add[c];
+        if (i > y0) {
+            const unsigned char* sub = IMG_ROW(original, i - r - 1);
+            for (int c = 0; c < W; c++) colsum[c] -= sub[c];
+        }
+
+        unsigned char* out = IMG_ROW(job->dst, i);
+        uint64_t sum = 0;
+        for (int c = 0; c < n - 1; c++) sum += colsum[c];
+        for (int j = r; j < W - r; j++) {
+            sum += colsum[j + r];
+            out[j] = (unsigned char)((sum * job->recip) >> 40);
+            sum -= colsum[j - r];
+        }
+    }
+
+    buffer_pool_put(colsum);
+}
+
+static PgmStatus box_filter(const PGMImage* original, PGMImage* new_img, int radius) {
+    int allocated;
+    PgmStatus status = prepare_output(original, new_img, original->width, original->height, 1, &allocated);
+    if (status != PGM_OK) return status;
+    int W = original->width;
+    int H = original->height;
+    int r = radius;
+    if (W <= 2 * r || H <= 2 * r) return PGM_OK;
+
+    const int n = 2 * r + 1;
+    const uint64_t area = (uint64_t)n * n;
+    BoxJob job = { original, new_img, r, (((uint64_t)1 << 40) + area - 1) / area, 0 };
+    parallel_rows(r, H - r, parallel_grain(W, 4 * n), box_filter_rows, &job);
+    return job.failed ? fail_output(new_img, allocated, PGM_ERR_NOMEM) : PGM_OK;
+}
+
+PgmStatus pgm_mean_filter(const PGMImage* src, PGMImage* dst, int radius) {
+    if (!image_is_valid(src) || radius < 1 || radius > PGM_MAX_FILTER_RADIUS) return PGM_ERR_ARGUMENT;
+    FramedOp op = { FRAMED_MEAN, radius, { NULL, NULL }, NULL, 0, { 0, 0 }, NULL };
+    return run_bordered(src, dst, &op);
+}
+
+void sort_nine(unsigned char arr[9]) {
+    for (int i = 0; i < 8; i++) {
+        for (int j = i + 1; j < 9; j++) {
+            if (arr[i] > arr[j]) {
+                unsigned char temp = arr[i];
+                arr[i] = arr[j];
+                arr[j] = temp;
+            }
+        }
+    }
+}
+
+// scalar reference, computes out[j] for j0 <= j < j1 from rows i-1, i, i+1
+void median_row_scalar(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {
+    unsigned char window[9];
+    for (int j = j0; j < j1; j++) {
+        int k = 0;
+        for (int row = -1; row <= 1; row++) {
+            for (int col = -1; col <= 1; col++) {
+                window[k++] = rows[row + 1][j + col];
+            }
+        }
+        sort_nine(window);
+        out[j] = window[4]; 
+    }
+}
+
+static PgmStatus median_filter(const PGMImage* original, PGMImage* new_img) {
+    return run_stencil(original, new_img, stencil_kernels.median, 1);
+}
+
+// Constant-time median for radius >= 2 (Perreault & Hebert sliding histograms).
+// Every column keeps a histogram of the 2r+1 rows around the current row, split in
+// 16 coarse bins and 256 fine bins. Moving one row down costs one add and one remove
+// per column, moving one pixel right adds one column histogram and removes another
+// from the 16 coarse kernel bins. Fine kernel bins are only brought up to date for
+// the coarse bin that holds the median, so the cost per pixel does not grow with r.
+// Pixels closer than r to the border keep their value, like the 3x3 filter.
+// Row bands run in parallel with their own column histograms.
+typedef struct {
+    const PGMImage* src;
+    PGMImage* dst;
+    int r;
+    int failed;
+} MedianJob;
+
+static void median_ctmf_rows(void* arg, int y0, int y1) {
+    MedianJob* job = (MedianJob*)arg;
+    const PGMImage* original = job->src;
+    int W = original->width;
+    int r = job->r;
+
+    uint16_t* coarse = (uint16_t*)buffer_pool_get((size_t)W * 16 * sizeof(uint16_t), 1);
+    uint16_t* fine = (uint16_t*)buffer_pool_get((size_t)W * 256 * sizeof(uint16_t), 1);
+    if (coarse == NULL || fine == NULL) {
+        buffer_pool_put(coarse); buffer_pool_put(fine);
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    const int n = 2 * r + 1;
+    const int rank = (n * n - 1) / 2;  // zero based rank of the median
+    for (int y = y0 - r; y < y0 + r; y++) {
+        const unsigned char* src = IMG_ROW(original, y);
+        for (int c = 0; c < W; c++) {
+            coarse[c * 16 + (src[c] >> 4)]++;
+            fine[c * 256 + src[c]]++;
+        }
+    }
+
+    for (int i = y0; i < y1; i++) {
+        // slide the column histograms down: add row i + r, drop row i - r - 1
+        const unsigned char* add = IMG_ROW(original, i + r);
+        for (int c = 0; c < W; c++) {
+            coarse[c * 16 + (add[c] >> 4)]++;
+            fine[c * 256 + add[c]]++;
+        }
+        if (i > y0) {
+            const unsigned char* sub = IMG_ROW(original, i - r - 1);
+            for (int c = 0; c < W; c++) {
+                coarse[c * 16 + (sub[c] >> 4)]--;
+                fine[c * 256 + sub[c]]--;
+            }
+        }
+
+        uint16_t kc[16] = {0};   // coarse kernel histogram
+        uint16_t kf[256];        // fine kernel histogram, valid per coarse bin
+        int luc[16];             // fine bin b covers columns [luc[b] - n, luc[b])
+        for (int c = 0; c < n - 1; c++) {
+            for (int b = 0; b < 16; b++) kc[b] += coarse[c * 16 + b];
+        }
+        for (int b = 0; b < 16; b++) luc[b] = 0;
+
+        unsigned char* out = IMG_ROW(job->dst, i);
+        for (int j = r; j < W - r; j++) {
+            const uint16_t* in_col = coarse + (j + r) * 16;
+            for (int b = 0; b < 16; b++) kc[b] += in_col[b];
+            if (j > r) {
+                const uint16_t* out_col = coarse + (j - r - 1) * 16;
+                for (int b = 0; b < 16; b++) kc[b] -= out_col[b];
+            }
+
+            int sum = 0, b = 0;
+            while (b < 15 && sum + kc[b] <= rank) sum += kc[b++];
+
+            uint16_t* kfb = kf + b * 16;
+            if (luc[b] <= j - r) {
+                // too far behind, rebuild this fine bin from the window columns
+                memset(kfb, 0, 16 * sizeof(uint16_t));
+                for (int c = j - r; c <= j + r; c++) {
+                    const uint16_t* f = fine + c * 256 + b * 16;
+                    for (int k = 0; k < 16; k++) kfb[k] += f[k];
+                }
+                luc[b] = j + r + 1;
+            } else {
+                for (; luc[b] < j + r + 1; luc[b]++) {
+                    const uint16_t* f_in = fine + luc[b] * 256 + b * 16;
+                    const uint16_t* f_out = fine + (luc[b] - n) * 256 + b * 16;
+                    for (int k = 0; k < 16; k++) kfb[k] += f_in[k] - f_out[k];
+                }
+            }
+
+            int k = 0;
+            while (k < 15 && sum + kfb[k] <= rank) sum += kfb[k++];
+            out[j] = (unsigned char)(b * 16 + k);
+        }
+    }
+
+    buffer_pool_put(coarse);
+    buffer_pool_put(fine);
+}
+
+static PgmStatus median_filter_ctmf(const PGMImage* original, PGMImage* new_img, int r) {
+    int allocated;
+    PgmStatus status = prepare_output(original, new_img, original->width, original->height, 1, &allocated);
+    if (status != PGM_OK) return status;
+    int W = original->width;
+    int H = original->height;
+    if (W <= 2 * r || H <= 2 * r) return PGM_OK;
+
+    MedianJob job = { original, new_img, r, 0 };
+    parallel_rows(r, H - r, parallel_grain(W, 4 * (2 * r + 1)), median_ctmf_rows, &job);
+    return job.failed ? fail_output(new_img, allocated, PGM_ERR_NOMEM) : PGM_OK;
+}
+
+// (2 * radius + 1)^2 median, radius 1 uses the sorting network kernels
+PgmStatus pgm_median_filter(const PGMImage* src, PGMImage* dst, int radius) {
+    if (!image_is_valid(src) || radius < 1 || radius > PGM_MAX_FILTER_RADIUS) return PGM_ERR_ARGUMENT;
+    FramedOp op = { FRAMED_MEDIAN, radius, { NULL, NULL }, NULL, 0, { 0, 0 }, NULL };
+    return run_bordered(src, dst, &op);
+}
+
+
+
+// Edge Detection
+
+// scalar reference, computes out[j] for j0 <= j < j1 from rows i-1, i, i+1
+void sobel_row_scalar(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {
+    const int Gx[3][3] = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
+    const int Gy[3][3] = {{-1, -2, -1}, {0, 0, 0}, {1, 2, 1}};
+    for (int j = j0; j < j1; j++) {
+        long gx_sum = 0;
+        long gy_sum = 0;
+        for (int k = -1; k <= 1; k++) {
+            for (int l = -1; l <= 1; l++) {
+                int pixel_val = rows[k + 1][j + l];
+                gx_sum += pixel_val * Gx[k + 1][l + 1];
+                gy_sum += pixel_val * Gy[k + 1][l + 1];
+            }
+        }
+        long magnitude = labs(gx_sum) + labs(gy_sum);
+        unsigned char final_value = (unsigned char)(magnitude > 255 ? 255 : magnitude);
+        out[j] = final_value;
+    }
+}
+
+PgmStatus pgm_sobel(const PGMImage* src, PGMImage* dst) {
+    if (!image_is_valid(src)) return PGM_ERR_ARGUMENT;
+    return pgm_convolve_gradient(src, dst, &sobel_x_kernel, &sobel_y_kernel);
+}
+
+// scalar reference, computes out[j] for j0 <= j < j1 from rows i-1, i, i+1
+void prewitt_row_scalar(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {
+    const int Gx[3][3] = {{-1, 0, 1}, {-1, 0, 1}, {-1, 0, 1}};
+    const int Gy[3][3] = {{-1, -1, -1}, {0, 0, 0}, {1, 1, 1}};
+    for (int j = j0; j < j1; j++) {
+        long gx_sum = 0;
+        long gy_sum = 0;
+        for (int k = -1; k <= 1; k++) {
+            for (int l = -1; l <= 1; l++) {
+                int pixel_val = rows[k + 1][j + l];
+                gx_sum += pixel_val * Gx[k + 1][l + 1];
+                gy_sum += pixel_val * Gy[k + 1][l + 1];
+            }
+        }
+        long magnitude = labs(gx_sum) + labs(gy_sum);
+        unsigned char final_value = (unsigned char)(magnitude > 255 ? 255 : magnitude);
+        out[j] = final_value;
+    }
+}
+
+PgmStatus pgm_prewitt(const PGMImage* src, PGMImage* dst) {
+    if (!image_is_valid(src)) return PGM_ERR_ARGUMENT;
+    return pgm_convolve_gradient(src, dst, &prewitt_x_kernel, &prewitt_y_kernel);
+}
+
+// Canny Edge Detector
+// Blur, gradient and non-maximum suppression run fused, one row at a time. Each
+// stage keeps a ring of three rows, so apart from the output image only a few rows
+// of intermediate data exist. The gradient direction is bucketed into the four
+// suppression sectors by comparing |gy| with tan(22.5) and tan(67.5) times |gx|,
+// which avoids atan2f. The fixed-point variant works on the unnormalized blur sums
+// and squared magnitudes and needs no float math at all.
+
+// the 5x5 Gaussian as a convolution plan (symmetric rows, unrolled 5 tap passes)
+static const PgmKernel canny_blur_kernel = { 5, 5, CANNY_BLUR_SUM, 0, 0, {
+    2, 4, 5, 4, 2,
+    4, 9, 12, 9, 4,
+    5, 12, 15, 12, 5,
+    4, 9, 12, 9, 4,
+    2, 4, 5, 4, 2 } };
+static ConvPlan canny_blur_plan;
+
+static void build_canny_blur_plan(void) __attribute__((constructor));
+static void build_canny_blur_plan(void) {
+    build_conv_plan(&canny_blur_kernel, 0, &canny_blur_plan);
+}
+
+// 5x5 Gaussian row sums (weights sum to 159); zero in the 2 pixel frame the kernel cannot cover
+void canny_blur_row(const PGMImage* img, int y, int* out) {
+    int W = img->width;
+    memset(out, 0, (size_t)W * sizeof(int));
+    if (y < 2 || y >= img->height - 2 || W < 5) return;
+    const unsigned char* rows[5];
+    for (int i = 0; i < 5; i++) rows[i] = IMG_ROW(img, y - 2 + i);
+    conv_accumulate_row(&canny_blur_plan, rows, out, 2, W - 2);
+}
+
+// suppression sector of a gradient: 0 horizontal, 1 diagonal (gx, gy same sign),
+// 2 vertical, 3 anti-diagonal
+static inline int canny_sector(float gx, float gy) {
+    float ax = fabsf(gx), ay = fabsf(gy);
+    if (ay <= CANNY_TAN_22_5 * ax) return 0;
+    if (ay >= CANNY_TAN_67_5 * ax) return 2;
+    return (gx > 0) == (gy > 0) ? 1 : 3;
+}
+
+static inline int canny_sector_fixed(int gx, int gy) {
+    int64_t ax = gx < 0 ? -(int64_t)gx : gx;
+    int64_t ay = gy < 0 ? -(int64_t)gy : gy;
+    if ((ay << 16) <= CANNY_TAN_22_5_Q16 * ax) return 0;
+    if ((ay << 16) >= CANNY_TAN_67_5_Q16 * ax) return 2;
+    return (gx > 0) == (gy > 0) ? 1 : 3;
+}
+
+// Sobel gradient of blur row y (rows b0, b1, b2 = y - 1, y, y + 1). The sums are
+// accumulated in the same order as the original 3x3 loop, so the magnitudes are
+// bit for bit those of the unfused version.
+void canny_gradient_row(const float* b0, const float* b1, const float* b2, int W,
+                        float* mag, unsigned char* sector) {
+    mag[0] = mag[W - 1] = 0.0f;
+    for (int j = 1; j < W - 1; j++) {
+        float gx = -b0[j - 1];
+        gx += b0[j + 1];
+        gx += -2.0f * b1[j - 1];
+        gx += 2.0f * b1[j + 1];
+        gx += -b2[j - 1];
+        gx += b2[j + 1];
+
+        float gy = -b0[j - 1];
+        gy += -2.0f * b0[j];
+        gy += -b0[j + 1];
+        gy += b2[j - 1];
+        gy += 2.0f * b2[j];
+        gy += b2[j + 1];
+
+        mag[j] = sqrtf(gx * gx + gy * gy);
+        sector[j] = (unsigned char)canny_sector(gx, gy);
+    }
+}
+
+// same on the integer blur sums, mag2 is the squared magnitude (scaled by 159^2)
+void canny_gradient_row_fixed(const int* b0, const int* b1, const int* b2, int W,
+                              int64_t* mag2, unsigned char* sector) {
+    mag2[0] = mag2[W - 1] = 0;
+    for (int j = 1; j < W - 1; j++) {
+        int gx = (b0[j + 1] - b0[j - 1]) + 2 * (b1[j + 1] - b1[j - 1]) + (b2[j + 1] - b2[j - 1]);
+        int gy = (b2[j - 1] - b0[j - 1]) + 2 * (b2[j] - b0[j]) + (b2[j + 1] - b0[j + 1]);
+        mag2[j] = (int64_t)gx * gx + (int64_t)gy * gy;
+        sector[j] = (unsigned char)canny_sector_fixed(gx, gy);
+    }
+}
+
+// keeps a pixel of row i only where it is a maximum across its edge (m0, m1, m2 = rows i - 1, i, i + 1)
+void canny_nms_row(const float* m0, const float* m1, const float* m2, const unsigned char* sector,
+                   int W, unsigned char* out) {
+    for (int j = 1; j < W - 1; j++) {
+        float q, r;
+        switch (sector[j]) {
+            case 0:  q = m1[j + 1]; r = m1[j - 1]; break;
+            case 1:  q = m0[j + 1]; r = m2[j - 1]; break;
+            case 2:  q = m0[j];     r = m2[j];     break;
+            default: q = m0[j - 1]; r = m2[j + 1]; break;
+        }
+        out[j] = (m1[j] >= q && m1[j] >= r) ? (unsigned char)fminf(m1[j], 255.0f) : 0;
+    }
+}
+
+// floor(sqrt(mag2) / 159) clamped to 255, bit by bit so no float sqrt is needed
+static inline unsigned char canny_fixed_magnitude(int64_t mag2) {
+    int k = 0;
+    for (int bit = 128; bit > 0; bit >>= 1) {
+        int64_t t = (int64_t)CANNY_BLUR_SUM * (k | bit);
+        if (t * t <= mag2) k |= bit;
+    }
+    return (unsigned char)k;
+}
+
+void canny_nms_row_fixed(const int64_t* m0, const int64_t* m1, const int64_t* m2,
+                         const unsigned char* sector, int W, unsigned char* out) {
+    for (int j = 1; j < W - 1; j++) {
+        int64_t q, r;
+        switch (sector[j]) {
+            case 0:  q = m1[j + 1]; r = m1[j - 1]; break;
+            case 1:  q = m0[j + 1]; r = m2[j - 1]; break;
+            case 2:  q = m0[j];     r = m2[j];     break;
+            default: q = m0[j - 1]; r = m2[j + 1]; break;
+        }
+        out[j] = (m1[j] >= q && m1[j] >= r) ? canny_fixed_magnitude(m1[j]) : 0;
+    }
+}
+
+typedef struct {
+    const PGMImage* img;
+    PGMImage* out;
+    int fixed_point;
+    int failed;
+    long stage_ns[3];  // thread CPU time in blur, gradient and NMS while profiling
+    uint64_t* hist;    // histogram of the suppressed rows, NULL if not needed
+    int hist_inset;    // rows and columns along the edges the histogram leaves out
+} CannyJob;
+
+// runs blur, gradient and suppression for output rows [i0, i1) into out (zeroed, same
+// size as img); rings of three rows per stage, row y of a stage is in slot y % 3.
+// A band recomputes the blur and gradient rows just above and below it.
+static void canny_suppress_rows(void* arg, int i0, int i1) {
+    CannyJob* job = (CannyJob*)arg;
+    const PGMImage* img = job->img;
+    PGMImage* out = job->out;
+    int fixed_point = job->fixed_point;
+    int W = img->width, H = img->height;
+    size_t mag_size = fixed_point ? sizeof(int64_t) : sizeof(float);
+    size_t blur_size = fixed_point ? sizeof(int) : sizeof(float);
+    unsigned char* block = (unsigned char*)buffer_pool_get((size_t)W * (3 * (blur_size + mag_size + 1) + sizeof(int)), 1);
+    if (block == NULL) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    unsigned char* mag[3];
+    unsigned char* blur[3];
+    unsigned char* sector[3];
+    for (int k = 0; k < 3; k++) {
+        mag[k] = block + (size_t)k * W * mag_size;
+        blur[k] = block + (size_t)W * (3 * mag_size + k * blur_size);
+        sector[k] = block + (size_t)W * (3 * (mag_size + blur_size) + sizeof(int)) + (size_t)k * W;
+    }
+    int* sums = (int*)(block + (size_t)W * 3 * (mag_size + blur_size));
+    uint32_t sub[4][256];
+    if (job->hist != NULL) memset(sub, 0, sizeof(sub));
+    int timed = profile_enabled;
+    double t_stage[3] = {0, 0, 0};
+    double t0 = timed ? profile_clock(CLOCK_THREAD_CPUTIME_ID) : 0, t1;
+
+    for (int y = i0 - 1; y <= i1; y++) {
+        // blur row y + 1 (rows y - 1 and y first), then the gradient of row y, then NMS of row y - 1
+        for (int b = (y == i0 - 1 ? y - 1 : y + 1); b <= y + 1 && b < H; b++) {
+            if (b < 0) continue;
+            int* dst = fixed_point ? (int*)blur[b % 3] : sums;
+            canny_blur_row(img, b, dst);
+            if (!fixed_point) {
+                float* f = (float*)blur[b % 3];
+                for (int j = 0; j < W; j++) f[j] = (float)sums[j] / CANNY_BLUR_SUM;
+            }
+        }
+        if (timed) { t1 = profile_clock(CLOCK_THREAD_CPUTIME_ID); t_stage[0] += t1 - t0; t0 = t1; }
+        if (y == 0 || y == H - 1) {
+            memset(mag[y % 3], 0, (size_t)W * mag_size);
+        } else if (fixed_point) {
+            canny_gradient_row_fixed((int*)blur[(y - 1) % 3], (int*)blur[y % 3], (int*)blur[(y + 1) % 3],
+                                     W, (int64_t*)mag[y % 3], sector[y % 3]);
+        } else {
+            canny_gradient_row((float*)blur[(y - 1) % 3], (float*)blur[y % 3], (float*)blur[(y + 1) % 3],
+                               W, (float*)mag[y % 3], sector[y % 3]);
+        }
+        if (timed) { t1 = profile_clock(CLOCK_THREAD_CPUTIME_ID); t_stage[1] += t1 - t0; t0 = t1; }
+        if (y - 1 >= i0) {
+            int i = y - 1;
+            if (fixed_point) {
+                canny_nms_row_fixed((int64_t*)mag[(i - 1) % 3], (int64_t*)mag[i % 3], (int64_t*)mag[y % 3],
+                                    sector[i % 3], W, IMG_ROW(out, i));
+            } else {
+                canny_nms_row((float*)mag[(i - 1) % 3], (float*)mag[i % 3], (float*)mag[y % 3],
+                              sector[i % 3], W, IMG_ROW(out, i));
+            }
+            int inset = job->hist_inset;
+            if (job->hist != NULL && i >= inset && i < H - inset) {
+                histogram_add_row(IMG_ROW(out, i) + inset, W - 2 * inset, sub);
+            }
+        }
+        if (timed) { t1 = profile_clock(CLOCK_THREAD_CPUTIME_ID); t_stage[2] += t1 - t0; t0 = t1; }
+    }
+    if (job->hist != NULL) histogram_flush(sub, job->hist);
+    buffer_pool_put(block);
+    for (int k = 0; timed && k < 3; k++) {
+        __atomic_add_fetch(&job->stage_ns[k], (long)(t_stage[k] * 1e9), __ATOMIC_RELAXED);
+    }
+}
+
+// hist (may be NULL) gets the histogram of the suppressed rows (the zero frame rows aside)
+// without inset rows and columns along the edges
+static PgmStatus canny_suppress_framed(const PGMImage* img, PGMImage* out, int fixed_point, uint64_t* hist,
+                                       int inset) {
+    static const char* stage_names[3] = { "canny blur", "canny gradient", "canny nms" };
+    int allocated;
+    PgmStatus status = prepare_output(img, out, img->width, img->height, 0, &allocated);
+    if (status != PGM_OK) return status;
+    if (hist != NULL) memset(hist, 0, 256 * sizeof(uint64_t));
+    CannyJob job = { img, out, fixed_point, 0, {0, 0, 0}, hist, inset };
+    pgm_profile_begin("canny suppress");
+    parallel_rows(1, img->height - 1, parallel_grain(img->width, 32), canny_suppress_rows, &job);
+    pgm_profile_end();
+    double seconds[3] = { job.stage_ns[0] * 1e-9, job.stage_ns[1] * 1e-9, job.stage_ns[2] * 1e-9 };
+    profile_add_fused(stage_names, seconds, 3);
+    return job.failed ? fail_output(out, allocated, PGM_ERR_NOMEM) : PGM_OK;
+}
+
+// Hysteresis without recursion: interior pixels >= low are grouped into horizontal
+// runs, runs touching in the row above (8-connectivity) are joined with union-find.
+// A component is kept when one of its pixels is >= high, which is exactly the set
+// the old recursive edge tracking reached from the strong pixels. Memory grows with
+// the number of runs, not with contour length, so long edges cannot exhaust the stack.
+// Row bands are labelled by separate threads and joined at the band seams.
+// final_edges may be the suppressed image itself.
+
+typedef struct {
+    int x0, x1;  // inclusive column range
+} EdgeRun;
+
+typedef struct {
+    unsigned char** suppressed;
+    unsigned char** final_edges;
+    int W;
+    int y0, y1;           // interior rows [y0, y1) of this band
+    int low, high;
+    EdgeRun* runs;
+    int* parent;          // band local union-find, later rewritten to global ids
+    unsigned char* strong;
+    int* row_start;       // runs of row y are [row_start[y - y0], row_start[y - y0 + 1])
+    int count, cap;
+    int offset;           // global id of the first run
+    const int* root_of;   // global parent table (set before the output phase)
+    const unsigned char* root_strong;
+    int ok;
+} HysteresisBand;
+
+static int uf_find(int* parent, int x) {
+    while (parent[x] != x) {
+        parent[x] = parent[parent[x]];  // path halving
+        x = parent[x];
+    }
+    return x;
+}
+
+// smaller id becomes the root so the result never depends on the order of unions
+static void uf_union(int* parent, unsigned char* strong, int a, int b) {
+    a = uf_find(parent, a);
+    b = uf_find(parent, b);
+    if (a == b) return;
+    if (b < a) { int t = a; a = b; b = t; }
+    parent[b] = a;
+    strong[a] |= strong[b];
+}
+
+// joins every run of a with the runs of b it touches directly or diagonally; both lists
+// are sorted by column and a_id/b_id are the union-find ids of their first runs
+static void join_adjacent_runs(const EdgeRun* a, int na, int a_id, const EdgeRun* b, int nb, int b_id,
+                               int* parent, unsigned char* strong) {
+    int k = 0;
+    for (int i = 0; i < na; i++) {
+        while (k < nb && b[k].x1 + 1 < a[i].x0) k++;
+        for (int m = k; m < nb && b[m].x0 <= a[i].x1 + 1; m++) {
+            uf_union(parent, strong, a_id + i, b_id + m);
+        }
+    }
+}
+
+static int band_push_run(HysteresisBand* b, int x0, int x1, int is_strong) {
+    if (b->count == b->cap) {
+        int cap = b->cap ? b->cap * 2 : 1024;
+        EdgeRun* runs = (EdgeRun*)buffer_pool_grow(b->runs, cap * sizeof(EdgeRun));
+        if (runs == NULL) return 0;
+        b->runs = runs;
+        int* parent = (int*)buffer_pool_grow(b->parent, cap * sizeof(int));
+        if (parent == NULL) return 0;
+        b->parent = parent;
+        unsigned char* strong = (unsigned char*)buffer_pool_grow(b->strong, cap);
+        if (strong == NULL) return 0;
+        b->strong = strong;
+        b->cap = cap;
+    }
+    b->runs[b->count].x0 = x0;
+    b->runs[b->count].x1 = x1;
+    b->parent[b->count] = b->count;
+    b->strong[b->count] = (unsigned char)is_strong;
+    b->count++;
+    return 1;
+}
+
+static void* hysteresis_label_band(void* arg) {
+    HysteresisBand* b = (HysteresisBand*)arg;
+    b->row_start = (int*)buffer_pool_get((size_t)(b->y1 - b->y0 + 1) * sizeof(int), 0);
+    if (b->row_start == NULL) { b->ok = 0; return NULL; }
+    for (int y = b->y0; y < b->y1; y++) {
+        const unsigned char* row = b->suppressed[y];
+        int first = b->count;
+        b->row_start[y - b->y0] = first;
+        for (int x = 1; x < b->W - 1; x++) {
+            if (row[x] < b->low) continue;
+            int x0 = x, is_strong = 0;
+            while (x < b->W - 1 && row[x] >= b->low) {
+                is_strong |= row[x] >= b->high;
+                x++;
+            }
+            if (!band_push_run(b, x0, x - 1, is_strong)) { b->ok = 0; return NULL; }
+        }
+        if (y > b->y0) {
+            int prev = b->row_start[y - 1 - b->y0];
+            join_adjacent_runs(b->runs + first, b->count - first, first,
+                               b->runs + prev, first - prev, prev, b->parent, b->strong);
+        }
+    }
+    b->row_start[b->y1 - b->y0] = b->count;
+    b->ok = 1;
+    return NULL;
+}
+
+// writes the interior rows of the band: kept runs become 255, everything else 0
+static void* hysteresis_write_band(void* arg) {
+    HysteresisBand* b = (HysteresisBand*)arg;
+    for (int y = b->y0; y < b->y1; y++) {
+        unsigned char* dst = b->final_edges[y];
+        memset(dst + 1, 0, b->W - 2);
+        for (int k = b->row_start[y - b->y0]; k < b->row_start[y - b->y0 + 1]; k++) {
+            if (b->root_strong[b->root_of[b->offset + k]]) {
+                memset(dst + b->runs[k].x0, 255, b->runs[k].x1 - b->runs[k].x0 + 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    char* bands;
+    size_t size;  // bytes per band
+    void* (*fn)(void*);
+} BandJob;
+
+static void band_job_rows(void* arg, int k0, int k1) {
+    const BandJob* job = (const BandJob*)arg;
+    for (int k = k0; k < k1; k++) job->fn(job->bands + (size_t)k * job->size);
+}
+
+// runs fn over every band (an array of nbands structs of size bytes) on the worker pool
+static void run_bands(void* bands, int nbands, size_t size, void* (*fn)(void*)) {
+    BandJob job = { (char*)bands, size, fn };
+    parallel_rows(0, nbands, 1, band_job_rows, &job);
+}
+
+static const PgmCannyThresholds default_canny_thresholds = {
+    PGM_CANNY_RATIO, LOW_THRESHOLD_RATIO, HIGH_THRESHOLD_RATIO
+};
+
+static int canny_thresholds_valid(const PgmCannyThresholds* t) {
+    if (t == NULL) return 1;
+    switch (t->mode) {
+        case PGM_CANNY_RATIO:      return t->low >= 0 && t->low <= t->high;
+        case PGM_CANNY_OTSU:       return t->low >= 0 && t->low <= 1;
+        case PGM_CANNY_PERCENTILE: return t->low >= 0 && t->low <= 1 && t->high >= 0 && t->high <= 100;
+        case PGM_CANNY_FIXED:      return t->low >= 0 && t->low <= t->high && t->high <= 255;
+    }
+    return 0;
+}
+
+// hysteresis thresholds from the histogram of the suppressed image
+static void canny_thresholds(const uint64_t hist[256], const PgmCannyThresholds* t, int* low, int* high) {
+    if (t == NULL) t = &default_canny_thresholds;
+    int max_val = 255;
+    while (max_val > 0 && hist[max_val] == 0) max_val--;
+    switch (t->mode) {
+        case PGM_CANNY_RATIO:
+            *high = (int)(max_val * t->high);
+            *low = (int)(max_val * t->low);
+            return;
+        case PGM_CANNY_FIXED:
+            *high = (int)t->high;
+            *low = (int)t->low;
+            return;
+        case PGM_CANNY_OTSU:
+            *high = histogram_otsu(hist, 1) + 1;
+            break;
+        default:  // PGM_CANNY_PERCENTILE
+            *high = histogram_percentile(hist, 1, t->high);
+            break;
+    }
+    // no response at all leaves high at 256: nothing is an edge
+    *low = (int)(*high * t->low);
+}
+
+// hist is the histogram of the suppressed image
+int hysteresis_thresholding(unsigned char** suppressed, int W, int H, unsigned char** final_edges,
+                            const uint64_t hist[256], const PgmCannyThresholds* thresholds) {
+    int high_thresh, low_thresh;
+    canny_thresholds(hist, thresholds, &low_thresh, &high_thresh);
+
+    // border rows and columns are never tracked, only strong pixels survive there
+    for (int i = 0; i < H; i++) {
+        int step = (i == 0 || i == H - 1 || W <= 2) ? 1 : W - 1;
+        for (int j = 0; j < W; j += step) {
+            final_edges[i][j] = suppressed[i][j] >= high_thresh ? 255 : 0;
+        }
+    }
+    if (H <= 2 || W <= 2) return 1;
+
+    // deterministic bands of at least 64 rows, one per worker
+    int interior = H - 2;
+    int nbands = worker_thread_count();
+    if (nbands > interior / 64) nbands = interior / 64;
+    if (nbands < 1) nbands = 1;
+
+    HysteresisBand bands[MAX_WORKER_THREADS];
+    memset(bands, 0, sizeof(bands));
+    for (int k = 0; k < nbands; k++) {
+        bands[k].suppressed = suppressed;
+        bands[k].final_edges = final_edges;
+        bands[k].W = W;
+        bands[k].y0 = 1 + (int)((long)interior * k / nbands);
+        bands[k].y1 = 1 + (int)((long)interior * (k + 1) / nbands);
+        bands[k].low = low_thresh;
+        bands[k].high = high_thresh;
+    }
+    run_bands(bands, nbands, sizeof(bands[0]), hysteresis_label_band);
+
+    int ok = 1, total = 0;
+    for (int k = 0; k < nbands; k++) {
+        ok &= bands[k].ok;
+        bands[k].offset = total;
+        total += bands[k].count;
+    }
+
+    int* parent = NULL;
+    unsigned char* strong = NULL;
+    if (ok) {
+        parent = (int*)buffer_pool_get((size_t)total * sizeof(int), 0);
+        strong = (unsigned char*)buffer_pool_get((size_t)total, 0);
+        ok = parent != NULL && strong != NULL;
+    }
+    if (ok) {
+        // move the band local trees into one global table, then join across the seams
+        for (int k = 0; k < nbands; k++) {
+            for (int i = 0; i < bands[k].count; i++) {
+                parent[bands[k].offset + i] = bands[k].offset + uf_find(bands[k].parent, i);
+                strong[bands[k].offset + i] = bands[k].strong[i];
+            }
+        }
+        for (int k = 0; k + 1 < nbands; k++) {
+            const HysteresisBand* up = &bands[k];
+            const HysteresisBand* down = &bands[k + 1];
+            int last = up->y1 - 1 - up->y0;
+            int a0 = up->row_start[last];
+            join_adjacent_runs(up->runs + a0, up->row_start[last + 1] - a0, up->offset + a0,
+                               down->runs, down->row_start[1], down->offset, parent, strong);
+        }
+    }
+    if (ok) {
+        for (int i = 0; i < total; i++) parent[i] = uf_find(parent, i);
+        for (int k = 0; k < nbands; k++) {
+            bands[k].root_of = parent;
+            bands[k].root_strong = strong;
+        }
+        run_bands(bands, nbands, sizeof(bands[0]), hysteresis_write_band);
+    }
+
+    for (int k = 0; k < nbands; k++) {
+        buffer_pool_put(bands[k].runs);
+        buffer_pool_put(bands[k].parent);
+        buffer_pool_put(bands[k].strong);
+        buffer_pool_put(bands[k].row_start);
+    }
+    buffer_pool_put(parent);
+    buffer_pool_put(strong);
+    return ok;
+}
+
+static PgmStatus hysteresis_with_histogram(PGMImage* img, const uint64_t hist[256],
+                                           const PgmCannyThresholds* thresholds) {
+    pgm_profile_begin("canny hysteresis");
+    int tracked = hysteresis_thresholding(img->pixels, img->width, img->height, img->pixels, hist, thresholds);
+    pgm_profile_end();
+    return tracked ? PGM_OK : PGM_ERR_NOMEM;
+}
+
+// on its own the image needs a histogram pass first
+PgmStatus pgm_hysteresis(PGMImage* img, const PgmCannyThresholds* thresholds) {
+    if (!image_is_valid(img) || img->map_base != NULL || !canny_thresholds_valid(thresholds)) {
+        return PGM_ERR_ARGUMENT;
+    }
+    uint64_t hist[256];
+    image_histogram(img, hist);
+    return hysteresis_with_histogram(img, hist, thresholds);
+}
+
+PgmStatus pgm_canny_suppress(const PGMImage* src, PGMImage* dst, int fixed_point) {
+    if (!image_is_valid(src)) return PGM_ERR_ARGUMENT;
+    FramedOp op = { FRAMED_CANNY_SUPPRESS, fixed_point, { NULL, NULL }, NULL, 0, { 0, 0 }, NULL };
+    return run_bordered(src, dst, &op);
+}
+
+static PgmStatus canny_framed(const PGMImage* src, PGMImage* dst, int fixed_point,
+                              const PgmCannyThresholds* thresholds) {
+    int allocated = dst != NULL && dst->pixels == NULL;
+
+    // Gaussian smoothing, gradient and non-maximum suppression in one pass,
+    // which also counts the histogram the thresholds come from
+    uint64_t hist[256];
+    PgmStatus status = canny_suppress_framed(src, dst, fixed_point, hist, 0);
+    if (status != PGM_OK) return status;
+
+    // Thresholding, in place
+    status = hysteresis_with_histogram(dst, hist, thresholds);
+    return status == PGM_OK ? PGM_OK : fail_output(dst, allocated, status);
+}
+
+PgmStatus pgm_canny(const PGMImage* src, PGMImage* dst, int fixed_point, const PgmCannyThresholds* thresholds) {
+    if (!image_is_valid(src) || !canny_thresholds_valid(thresholds)) return PGM_ERR_ARGUMENT;
+    FramedOp op = { FRAMED_CANNY, fixed_point, { NULL, NULL }, NULL, 0, { 0, 0 }, thresholds };
+    return run_bordered(src, dst, &op);
+}
+
+
+
+
+// Compute Local Binary Pattern (LBP)
+
+// scalar reference, computes out[j] for j0 <= j < j1 from rows i-1, i, i+1
+void lbp_row_scalar(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {
+    const int offsets[8][2] = {{-1, -1}, {-1, 0}, {-1, 1}, {0, 1}, 
+                             {1, 1}, {1, 0}, {1, -1}, {0, -1}};
+
+    for (int j = j0; j < j1; j++) {
+        unsigned char center = rows[1][j];
+        int lbp_code = 0;
+
+        for (int k = 0; k < 8; k++) {
+            int ni = 1 + offsets[k][0]; 
+            int nj = j + offsets[k][1]; 
+            unsigned char neighbor = rows[ni][nj];
+
+            if (neighbor >= center) {
+                lbp_code |= (1 << (7 - k));
+            }
+        }
+        out[j] = (unsigned char)lbp_code;
+    }
+}
+
+
+
+// LBP feature extraction: codes are remapped through a 256 entry table and counted
+// into per-cell histograms in the same pass that computes them, so no code image has
+// to be stored and read back. Rows are split over the worker pool, each chunk counts
+// into its own histograms and adds them to the result when done (integer sums, so the
+// result does not depend on the order).
+
+static unsigned char lbp_uniform_map[256];
+static unsigned char lbp_rotinv_map[256];
+static unsigned char lbp_raw_map[256];
+static pthread_once_t lbp_maps_once = PTHREAD_ONCE_INIT;
+
+static unsigned char rotate_left8(unsigned char v, int n) {
+    return (unsigned char)((v << n) | (v >> (8 - n)));
+}
+
+// the 8 neighbours are stored in circular order, so rotating the code rotates the pattern
+static void build_lbp_maps(void) {
+    int uniform_bins = 0, rotinv_bins = 0;
+    int rotinv_index[256];
+    for (int code = 0; code < 256; code++) {
+        lbp_raw_map[code] = (unsigned char)code;
+
+        int transitions = __builtin_popcount(code ^ rotate_left8((unsigned char)code, 1));
+        lbp_uniform_map[code] = transitions <= 2 ? (unsigned char)uniform_bins++ : 58;
+
+        unsigned char min_rot = (unsigned char)code;
+        for (int n = 1; n < 8; n++) {
+            unsigned char r = rotate_left8((unsigned char)code, n);
+            if (r < min_rot) min_rot = r;
+        }
+        // the smallest rotation of a class is met before any other member of it
+        if (min_rot == code) rotinv_index[code] = rotinv_bins++;
+        lbp_rotinv_map[code] = (unsigned char)rotinv_index[min_rot];
+    }
+}
+
+int pgm_lbp_bin_count(LbpMapping mapping) {
+    switch (mapping) {
+        case LBP_MAP_UNIFORM: return 59;
+        case LBP_MAP_ROTINV:  return 36;
+        default:              return 256;
+    }
+}
+
+const unsigned char* lbp_mapping_table(LbpMapping mapping) {
+    pthread_once(&lbp_maps_once, build_lbp_maps);
+    switch (mapping) {
+        case LBP_MAP_UNIFORM: return lbp_uniform_map;
+        case LBP_MAP_ROTINV:  return lbp_rotinv_map;
+        default:              return lbp_raw_map;
+    }
+}
+
+typedef struct {
+    const PGMImage* src;
+    PGMImage* dst;                // mapped code image, NULL when only histogramming
+    const unsigned char* map;     // NULL for raw codes
+    int bins, cells_x, cells_y;
+    const int* cell_of_col;       // histogram cell column of every image column
+    uint32_t* hist;               // cells_y * cells_x * bins, NULL for no histograms
+    int failed;
+} LbpJob;
+
+static void lbp_job_rows(void* arg, int y0, int y1) {
+    LbpJob* job = (LbpJob*)arg;
+    int W = job->src->width;
+    int H = job->src->height;
+    size_t cells = (size_t)job->cells_x * job->bins;
+    unsigned char* codes = NULL;
+    uint32_t* local = NULL;
+    if (job->hist != NULL) {
+        codes = (unsigned char*)buffer_pool_get((size_t)W, 0);
+        local = (uint32_t*)buffer_pool_get((size_t)job->cells_y * cells * sizeof(uint32_t), 1);
+        if (codes == NULL || local == NULL) {
+            buffer_pool_put(codes); buffer_pool_put(local);
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    for (int i = y0; i < y1; i++) {
+        const unsigned char* rows[3] = { IMG_ROW(job->src, i - 1), IMG_ROW(job->src, i), IMG_ROW(job->src, i + 1) };
+        unsigned char* out = job->dst != NULL ? IMG_ROW(job->dst, i) : codes;
+        stencil_kernels.lbp(rows, out, 1, W - 1);
+        if (job->map != NULL) {
+            for (int j = 1; j < W - 1; j++) out[j] = job->map[out[j]];
+        }
+        if (local != NULL) {
+            uint32_t* row_hist = local + (size_t)((long)i * job->cells_y / H) * cells;
+            for (int j = 1; j < W - 1; j++) row_hist[job->cell_of_col[j] + out[j]]++;
+        }
+    }
+
+    if (local != NULL) {
+        size_t n = (size_t)job->cells_y * cells;
+        for (size_t k = 0; k < n; k++) {
+            if (local[k] != 0) __atomic_fetch_add(&job->hist[k], local[k], __ATOMIC_RELAXED);
+        }
+    }
+    buffer_pool_put(codes);
+    buffer_pool_put(local);
+}
+
+// LBP code image with the codes remapped (raw keeps the plain 8-bit codes)
+static PgmStatus lbp_framed(const PGMImage* src, PGMImage* dst, LbpMapping mapping) {
+    if (mapping == LBP_MAP_RAW) return run_stencil(src, dst, stencil_kernels.lbp, 0);
+    int allocated;
+    PgmStatus status = prepare_output(src, dst, src->width, src->height, 0, &allocated);
+    if (status != PGM_OK) return status;
+    LbpJob job = { src, dst, lbp_mapping_table(mapping), 0, 0, 0, NULL, NULL, 0 };
+    parallel_rows(1, src->height - 1, parallel_grain(src->width, 1), lbp_job_rows, &job);
+    return PGM_OK;
+}
+
+PgmStatus pgm_lbp(const PGMImage* src, PGMImage* dst, LbpMapping mapping) {
+    if (!image_is_valid(src) || mapping < LBP_MAP_RAW || mapping > LBP_MAP_ROTINV) return PGM_ERR_ARGUMENT;
+    FramedOp op = { FRAMED_LBP, mapping, { NULL, NULL }, NULL, 0, { 0, 0 }, NULL };
+    return run_bordered(src, dst, &op);
+}
+
+
+// Histograms of the mapped codes over a cells_x x cells_y grid. Cell (cx, cy) covers
+// columns [cx * W / cells_x, (cx + 1) * W / cells_x) and the same split of the rows;
+// the one pixel frame without a code is not counted. hist gets cells_y * cells_x * bins
+// counts (cell row major, bins contiguous).
+PgmStatus pgm_lbp_histograms(const PGMImage* img, LbpMapping mapping, int cells_x, int cells_y,
+                             uint32_t* hist) {
+    if (!image_is_valid(img) || hist == NULL || mapping < LBP_MAP_RAW || mapping > LBP_MAP_ROTINV ||
+        cells_x < 1 || cells_y < 1 || cells_x > img->width || cells_y > img->height) return PGM_ERR_ARGUMENT;
+    int W = img->width, H = img->height;
+    int bins = pgm_lbp_bin_count(mapping);
+    memset(hist, 0, (size_t)cells_x * cells_y * bins * sizeof(uint32_t));
+    int* cell_of_col = (int*)buffer_pool_get((size_t)W * sizeof(int), 0);
+    if (cell_of_col == NULL) return PGM_ERR_NOMEM;
+    for (int j = 0; j < W; j++) cell_of_col[j] = (int)((long)j * cells_x / W) * bins;
+
+    LbpJob job = { img, NULL, mapping == LBP_MAP_RAW ? NULL : lbp_mapping_table(mapping),
+                   bins, cells_x, cells_y, cell_of_col, hist, 0 };
+    parallel_rows(1, H - 1, parallel_grain(W, 16), lbp_job_rows, &job);
+    buffer_pool_put(cell_of_col);
+    return job.failed ? PGM_ERR_NOMEM : PGM_OK;
+}
+
+static int write_u32_le(FILE* fp, uint32_t v) {
+    unsigned char b[4] = { (unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24) };
+    return fwrite(b, 1, 4, fp) == 4;
+}
+
+// Feature file, all fields little endian:
+//   "LBPF", u32 version (1), u32 mapping (0 raw, 1 uniform, 2 rotinv), u32 bins,
+//   u32 cells_x, u32 cells_y, u32 width, u32 height, u32 count_bytes (2 or 4),
+//   then cells_y * cells_x * bins counts of count_bytes each, cell row major.
+// Counts are 16 bit whenever no cell can hold more than 65535 pixels.
+PgmStatus pgm_save_lbp_features(const char* filename, const PGMImage* img, LbpMapping mapping,
+                                int cells_x, int cells_y, const uint32_t* hist) {
+    if (filename == NULL || !image_is_valid(img) || hist == NULL || cells_x < 1 || cells_y < 1 ||
+        mapping < LBP_MAP_RAW || mapping > LBP_MAP_ROTINV) return PGM_ERR_ARGUMENT;
+    int W = img->width, H = img->height;
+    int bins = pgm_lbp_bin_count(mapping);
+    long max_cell = (long)(W / cells_x + 1) * (H / cells_y + 1);
+    int count_bytes = max_cell <= 65535 ? 2 : 4;
+
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL) return PGM_ERR_IO;
+    int ok = fwrite("LBPF", 1, 4, fp) == 4;
+    uint32_t header[8] = { 1, (uint32_t)mapping, (uint32_t)bins, (uint32_t)cells_x, (uint32_t)cells_y,
+                           (uint32_t)W, (uint32_t)H, (uint32_t)count_bytes };
+    for (int k = 0; k < 8 && ok; k++) ok = write_u32_le(fp, header[k]);
+
+    size_t n = (size_t)cells_x * cells_y * bins;
+    unsigned char* body = (unsigned char*)buffer_pool_get(n * count_bytes, 0);
+    PgmStatus status = body == NULL ? PGM_ERR_NOMEM : PGM_ERR_IO;
+    if (body == NULL) ok = 0;
+    for (size_t k = 0; ok && k < n; k++) {
+        for (int b = 0; b < count_bytes; b++) body[k * count_bytes + b] = (unsigned char)(hist[k] >> (8 * b));
+    }
+    if (ok) ok = fwrite(body, count_bytes, n, fp) == n;
+    buffer_pool_put(body);
+    ok = fclose(fp) == 0 && ok;
+    return ok ? PGM_OK : status;
+}
+
+
+
+// Morphology
+// Erosion (window minimum) and dilation (window maximum) with a rectangle are
+// separable: a horizontal pass over every row, then a vertical pass over its results.
+// Each 1-D pass is van Herk / Gil-Werman: the line is cut into blocks of k (the element
+// size), g runs the extremum forward within each block and h backward, and a window of
+// k covers the tail of one block and the head of the next, so out[x] = min(h[x],
+// g[x + k - 1]) - three comparisons per pixel whatever k is. Positions outside the
+// image hold the identity (255 for the minimum, 0 for the maximum), which cuts the
+// window at the image edge. Row bands run the horizontal pass over their rows and the
+// k - 1 rows of context, then the vertical pass on whole rows at a time.
+// Images with at most two values (Canny output, thresholds) are packed 64 pixels to a
+// word, 1 for the higher value: the maximum is OR, erosion is the dilation of the
+// complement, a row is dilated with log2(k) shift-ORs of doubling length, and opening,
+// closing and the gradient stay packed between their two passes.
+
+typedef struct {
+    const PGMImage* src;
+    PGMImage* dst;
+    int ax, bx, ay, by;  // reach of the window left, right, up and down
+    int is_max;
+    int failed;
+} MorphJob;
+
+static inline unsigned char morph_pick(unsigned char x, unsigned char y, int is_max) {
+    return is_max ? (x > y ? x : y) : (x < y ? x : y);
+}
+
+// out[j] = min (max) of x[j] and y[j]; out may be x
+static void morph_pick_row(unsigned char* out, const unsigned char* x, const unsigned char* y, int n, int is_max) {
+    if (is_max) {
+        for (int j = 0; j < n; j++) out[j] = x[j] > y[j] ? x[j] : y[j];
+    } else {
+        for (int j = 0; j < n; j++) out[j] = x[j] < y[j] ? x[j] : y[j];
+    }
+}
+
+// out[x] = min (max) of s[x - a .. x + b] within 0..W-1; p and h hold W + a + b bytes
+static void morph_row(const unsigned char* s, unsigned char* out, int W, int a, int b, int is_max,
+                      unsigned char* p, unsigned char* h) {
+    const int k = a + b + 1, n = W + k - 1;
+    memset(p, is_max ? 0 : 255, a);
+    memcpy(p + a, s, W);
+    memset(p + a + W, is_max ? 0 : 255, b);
+    for (int start = 0; start < n; start += k) {
+        int end = start + k < n ? start + k : n;
+        h[end - 1] = p[end - 1];
+        for (int i = end - 2; i >= start; i--) h[i] = morph_pick(p[i], h[i + 1], is_max);
+        for (int i = start + 1; i < end; i++) p[i] = morph_pick(p[i], p[i - 1], is_max);
+    }
+    for (int x = 0; x < W; x++) out[x] = morph_pick(h[x], p[x + k - 1], is_max);
+}
+
+static void morph_rows(void* arg, int y0, int y1) {
+    MorphJob* job = (MorphJob*)arg;
+    const PGMImage* src = job->src;
+    int W = src->width, H = src->height;
+    const int kx = job->ax + job->bx + 1, ky = job->ay + job->by + 1;
+    const int n = y1 - y0 + ky - 1;
+    size_t rs = align_up((size_t)W);
+
+    unsigned char* g = (unsigned char*)buffer_pool_get((size_t)n * rs, 0);
+    unsigned char* h = (unsigned char*)buffer_pool_get((size_t)n * rs, 0);
+    unsigned char* line = (unsigned char*)buffer_pool_get(2 * (size_t)(W + kx - 1), 0);
+    if (g == NULL || h == NULL || line == NULL) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        buffer_pool_put(g);
+        buffer_pool_put(h);
+        buffer_pool_put(line);
+        return;
+    }
+
+    // horizontal pass of rows y0 - ay .. y1 - 1 + by, identity rows outside the image
+    for (int i = 0; i < n; i++) {
+        int y = y0 - job->ay + i;
+        unsigned char* row = g + i * rs;
+        if (y < 0 || y >= H) memset(row, job->is_max ? 0 : 255, W);
+        else if (kx == 1) memcpy(row, IMG_ROW(src, y), W);
+        else morph_row(IMG_ROW(src, y), row, W, job->ax, job->bx, job->is_max, line, line + W + kx - 1);
+    }
+
+    // vertical pass: h backward within each block of ky rows, then g forward in place
+    for (int start = 0; start < n && ky > 1; start += ky) {
+        int end = start + ky < n ? start + ky : n;
+        memcpy(h + (end - 1) * rs, g + (end - 1) * rs, W);
+        for (int i = end - 2; i >= start; i--) morph_pick_row(h + i * rs, g + i * rs, h + (i + 1) * rs, W, job->is_max);
+        for (int i = start + 1; i < end; i++) morph_pick_row(g + i * rs, g + i * rs, g + (i - 1) * rs, W, job->is_max);
+    }
+    for (int t = 0; t < y1 - y0; t++) {
+        unsigned char* out = IMG_ROW(job->dst, y0 + t);
+        if (ky == 1) memcpy(out, g + t * rs, W);
+        else morph_pick_row(out, h + t * rs, g + (t + ky - 1) * rs, W, job->is_max);
+    }
+
+    buffer_pool_put(g);
+    buffer_pool_put(h);
+    buffer_pool_put(line);
+}
+
+// reach of a size w window on each side of its pixel, no further than the image goes
+static void morph_reach(int w, int n, int* before, int* after) {
+    *before = w / 2 < n - 1 ? w / 2 : n - 1;
+    *after = (w - 1) / 2 < n - 1 ? (w - 1) / 2 : n - 1;
+}
+
+// one erosion or dilation of src into dst (W x H, any stride)
+static PgmStatus morph_pass(const PGMImage* src, PGMImage* dst, int w, int h, int is_max) {
+    MorphJob job = { src, dst, 0, 0, 0, 0, is_max, 0 };
+    morph_reach(w, src->width, &job.ax, &job.bx);
+    morph_reach(h, src->height, &job.ay, &job.by);
+    parallel_rows(0, src->height, parallel_grain(src->width, 2 * (job.ay + job.by + 1)), morph_rows, &job);
+    return job.failed ? PGM_ERR_NOMEM : PGM_OK;
+}
+
+static PgmStatus morphology_gray(const PGMImage* src, PGMImage* dst, PgmMorphOp op, int w, int h) {
+    if (op == PGM_MORPH_ERODE || op == PGM_MORPH_DILATE) return morph_pass(src, dst, w, h, op == PGM_MORPH_DILATE);
+
+    // opening erodes first, closing and the gradient dilate first
+    PGMImage tmp = {0};
+    if (!alloc_image_buffer(&tmp, src->width, src->height, 0)) return PGM_ERR_NOMEM;
+    int first_max = op != PGM_MORPH_OPEN;
+    PgmStatus status = morph_pass(src, &tmp, w, h, first_max);
+    if (status == PGM_OK) status = morph_pass(op == PGM_MORPH_GRADIENT ? src : &tmp, dst, w, h, !first_max);
+    if (status == PGM_OK && op == PGM_MORPH_GRADIENT) {
+        for (int i = 0; i < src->height; i++) {
+            const unsigned char* hi = IMG_ROW(&tmp, i);
+            unsigned char* out = IMG_ROW(dst, i);
+            for (int j = 0; j < src->width; j++) out[j] = (unsigned char)(hi[j] - out[j]);
+        }
+    }
+    free_image_memory(&tmp);
+    return status;
+}
+
+// 1 when img holds at most two values, *lo <= *hi (equal for a flat image)
+static int two_level_image(const PGMImage* img, int* lo, int* hi) {
+    int W = img->width;
+    unsigned char a = img->data[0], b = a;
+    for (int i = 0; i < img->height; i++) {
+        const unsigned char* row = IMG_ROW(img, i);
+        int other = 0;
+        for (int j = 0; j < W; j++) other |= (row[j] != a) & (row[j] != b);
+        if (!other) continue;
+        if (a != b) return 0;
+        // the first row with a second value: take it, check the row again
+        for (int j = 0; j < W; j++) {
+            if (row[j] != a) {
+                b = row[j];
+                break;
+            }
+        }
+        other = 0;
+        for (int j = 0; j < W; j++) other |= (row[j] != a) & (row[j] != b);
+        if (other) return 0;
+    }
+    *lo = a < b ? a : b;
+    *hi = a < b ? b : a;
+    return 1;
+}
+
+// packing runs 8 pixels per step on little endian words; elsewhere pixel by pixel
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BITS_SWAR 1
+#else
+#define BITS_SWAR 0
+#endif
+
+#define BYTES_LOW7 0x7F7F7F7F7F7F7F7FULL
+#define BYTES_HIGH 0x8080808080808080ULL
+#define BYTES_ONE 0x0101010101010101ULL
+
+// bit 7 of every byte of v that is 0 (exact, no carries between the bytes)
+static inline uint64_t zero_byte_mask(uint64_t v) {
+    return ~(((v & BYTES_LOW7) + BYTES_LOW7) | v) & BYTES_HIGH;
+}
+
+typedef struct {
+    const PGMImage* img;
+    PGMImage* out;
+    uint64_t* bits;
+    const uint64_t* minus;  // unpacking: bits & ~minus (NULL for none)
+    int words, lo, hi;
+} BitsPackJob;
+
+// bit j of a row word = pixel j equals hi
+static void bits_pack_rows(void* arg, int y0, int y1) {
+    BitsPackJob* job = (BitsPackJob*)arg;
+    int W = job->img->width;
+    uint64_t hi8 = BYTES_ONE * (uint64_t)job->hi;
+    for (int i = y0; i < y1; i++) {
+        const unsigned char* p = IMG_ROW(job->img, i);
+        uint64_t* out = job->bits + (size_t)i * job->words;
+        for (int w = 0; w < job->words; w++, p += 64) {
+            int n = W - 64 * w < 64 ? W - 64 * w : 64;
+            uint64_t bits = 0;
+            int j = 0;
+            for (; BITS_SWAR && j + 8 <= n; j += 8) {
+                uint64_t x;
+                memcpy(&x, p + j, 8);
+                uint64_t eq = zero_byte_mask(x ^ hi8);  // the pixels equal to hi
+                bits |= (((eq >> 7) * 0x0102040810204080ULL) >> 56) << j;
+            }
+            for (; j < n; j++) bits |= (uint64_t)(p[j] == job->hi) << j;
+            out[w] = bits;
+        }
+    }
+}
+
+// 1 bits become hi, 0 bits lo
+static void bits_unpack_rows(void* arg, int y0, int y1) {
+    BitsPackJob* job = (BitsPackJob*)arg;
+    int W = job->out->width;
+    uint64_t lo8 = BYTES_ONE * (uint64_t)job->lo, diff = (uint64_t)(job->lo ^ job->hi);
+    for (int i = y0; i < y1; i++) {
+        unsigned char* p = IMG_ROW(job->out, i);
+        const uint64_t* in = job->bits + (size_t)i * job->words;
+        const uint64_t* minus = job->minus != NULL ? job->minus + (size_t)i * job->words : NULL;
+        for (int w = 0; w < job->words; w++, p += 64) {
+            int n = W - 64 * w < 64 ? W - 64 * w : 64;
+            uint64_t bits = in[w] & ~(minus != NULL ? minus[w] : 0);
+            int j = 0;
+            for (; BITS_SWAR && j + 8 <= n; j += 8) {
+                // byte k of x keeps bit k of the 8, adding 0x7F carries it into bit 7
+                uint64_t x = (BYTES_ONE * ((bits >> j) & 0xFF)) & 0x8040201008040201ULL;
+                uint64_t v = lo8 ^ ((((x + BYTES_LOW7) >> 7) & BYTES_ONE) * diff);
+                memcpy(p + j, &v, 8);
+            }
+            for (; j < n; j++) p[j] = (unsigned char)((bits >> j) & 1 ? job->hi : job->lo);
+        }
+    }
+}
+
+// out bit p = in bit p + n, zeros shifted in
+static void bits_shift_down(const uint64_t* in, uint64_t* out, int words, int n) {
+    int q = n / 64, r = n % 64;
+    for (int w = 0; w < words; w++) {
+        uint64_t a = w + q < words ? in[w + q] : 0;
+        uint64_t b = w + q + 1 < words ? in[w + q + 1] : 0;
+        out[w] = r == 0 ? a : (a >> r) | (b << (64 - r));
+    }
+}
+
+// out bit p = in bit p - n, zeros shifted in
+static void bits_shift_up(const uint64_t* in, uint64_t* out, int words, int n) {
+    int q = n / 64, r = n % 64;
+    for (int w = 0; w < words; w++) {
+        uint64_t a = w - q >= 0 ? in[w - q] : 0;
+        uint64_t b = w - q - 1 >= 0 ? in[w - q - 1] : 0;
+        out[w] = r == 0 ? a : (a << r) | (b >> (64 - r));
+    }
+}
+
+typedef struct {
+    const uint64_t* src;
+    uint64_t* dst;
+    int W, H, words;
+    int ax, bx, ay, by;
+    int invert;     // dilate the complement and complement the result: erosion
+    uint64_t tail;  // the bits of the last word of a row that are pixels
+    int failed;
+} BitsJob;
+
+// s[p] becomes the OR of the k bits p .. p + k - 1 (toward_low: p - k + 1 .. p), windows
+// of doubling length m = 1, 2, 4 .. and a last step that overlaps two of them
+static void bits_window_or(uint64_t* s, uint64_t* t, int words, int k, int toward_low) {
+    int m = 1;
+    while (m < k) {
+        int step = 2 * m <= k ? m : k - m;
+        if (toward_low) bits_shift_up(s, t, words, step);
+        else bits_shift_down(s, t, words, step);
+        for (int w = 0; w < words; w++) s[w] |= t[w];
+        m += step;
+    }
+}
+
+// row dilation: out bit x = OR of row bits x - a .. x + b, as the windows reaching
+// left and right from x (the bits outside the row are 0); scratch holds 2 * words
+static void bits_dilate_row(const uint64_t* row, uint64_t* out, int words, int a, int b, uint64_t* scratch) {
+    uint64_t* t = scratch + words;
+    memcpy(out, row, words * sizeof(uint64_t));
+    bits_window_or(out, t, words, b + 1, 0);
+    if (a > 0) {
+        memcpy(scratch, row, words * sizeof(uint64_t));
+        bits_window_or(scratch, t, words, a + 1, 1);
+        for (int w = 0; w < words; w++) out[w] |= scratch[w];
+    }
+}
+
+static void bits_dilate_rows(void* arg, int y0, int y1) {
+    BitsJob* job = (BitsJob*)arg;
+    const int words = job->words, ky = job->ay + job->by + 1;
+    const int n = y1 - y0 + ky - 1;
+    const uint64_t flip = job->invert ? ~(uint64_t)0 : 0;
+
+    uint64_t* g = (uint64_t*)buffer_pool_get((size_t)n * words * sizeof(uint64_t), 0);
+    uint64_t* h = (uint64_t*)buffer_pool_get((size_t)n * words * sizeof(uint64_t), 0);
+    uint64_t* line = (uint64_t*)buffer_pool_get(3 * (size_t)words * sizeof(uint64_t), 0);
+    if (g == NULL || h == NULL || line == NULL) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        buffer_pool_put(g);
+        buffer_pool_put(h);
+        buffer_pool_put(line);
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        int y = y0 - job->ay + i;
+        uint64_t* row = g + (size_t)i * words;
+        if (y < 0 || y >= job->H) {
+            memset(row, 0, words * sizeof(uint64_t));
+            continue;
+        }
+        const uint64_t* in = job->src + (size_t)y * words;
+        uint64_t* s = job->ax + job->bx > 0 ? line : row;
+        for (int w = 0; w < words; w++) s[w] = in[w] ^ flip;
+        s[words - 1] &= job->tail;
+        if (s == line) {
+            bits_dilate_row(line, row, words, job->ax, job->bx, line + words);
+            row[words - 1] &= job->tail;
+        }
+    }
+
+    for (int start = 0; start < n && ky > 1; start += ky) {
+        int end = start + ky < n ? start + ky : n;
+        memcpy(h + (size_t)(end - 1) * words, g + (size_t)(end - 1) * words, words * sizeof(uint64_t));
+        for (int i = end - 2; i >= start; i--) {
+            for (int w = 0; w < words; w++) h[(size_t)i * words + w] = g[(size_t)i * words + w] | h[(size_t)(i + 1) * words + w];
+        }
+        for (int i = start + 1; i < end; i++) {
+            for (int w = 0; w < words; w++) g[(size_t)i * words + w] |= g[(size_t)(i - 1) * words + w];
+        }
+    }
+    for (int t = 0; t < y1 - y0; t++) {
+        uint64_t* out = job->dst + (size_t)(y0 + t) * words;
+        const uint64_t* hr = h + (size_t)t * words;
+        const uint64_t* gr = g + (size_t)(t + ky - 1) * words;
+        for (int w = 0; w < words; w++) out[w] = (ky == 1 ? gr[w] : hr[w] | gr[w]) ^ flip;
+        out[words - 1] &= job->tail;
+    }
+
+    buffer_pool_put(g);
+    buffer_pool_put(h);
+    buffer_pool_put(line);
+}
+
+// dilation (erosion with invert) of packed W x H rows
+static PgmStatus bits_dilate(const uint64_t* src, uint64_t* dst, int W, int H, int w, int h, int invert) {
+    BitsJob job = { src, dst, W, H, (W + 63) / 64, 0, 0, 0, 0, invert,
+                    W % 64 != 0 ? ((uint64_t)1 << (W % 64)) - 1 : ~(uint64_t)0, 0 };
+    morph_reach(w, W, &job.ax, &job.bx);
+    morph_reach(h, H, &job.ay, &job.by);
+    parallel_rows(0, H, parallel_grain((W + 7) / 8, 2 * (job.ay + job.by + 1)), bits_dilate_rows, &job);
+    return job.failed ? PGM_ERR_NOMEM : PGM_OK;
+}
+
+static PgmStatus morphology_bits(const PGMImage* src, PGMImage* dst, PgmMorphOp op, int w, int h, int lo, int hi) {
+    int W = src->width, H = src->height;
+    int words = (W + 63) / 64;
+    size_t size = (size_t)words * H * sizeof(uint64_t);
+    uint64_t* a = (uint64_t*)buffer_pool_get(size, 0);
+    uint64_t* b = (uint64_t*)buffer_pool_get(size, 0);
+    uint64_t* c = op == PGM_MORPH_GRADIENT ? (uint64_t*)buffer_pool_get(size, 0) : NULL;
+    PgmStatus status = PGM_ERR_NOMEM;
+    if (a != NULL && b != NULL && (c != NULL || op != PGM_MORPH_GRADIENT)) {
+        BitsPackJob job = { src, dst, a, NULL, words, lo, hi };
+        parallel_rows(0, H, parallel_grain(W, 1), bits_pack_rows, &job);
+        switch (op) {
+            case PGM_MORPH_ERODE:
+            case PGM_MORPH_DILATE:
+                status = bits_dilate(a, b, W, H, w, h, op == PGM_MORPH_ERODE);
+                job.bits = b;
+                break;
+            case PGM_MORPH_OPEN:
+            case PGM_MORPH_CLOSE:
+                status = bits_dilate(a, b, W, H, w, h, op == PGM_MORPH_OPEN);
+                if (status == PGM_OK) status = bits_dilate(b, a, W, H, w, h, op == PGM_MORPH_CLOSE);
+                break;
+            case PGM_MORPH_GRADIENT:
+                // dilated and not eroded: hi - lo, 0 elsewhere
+                status = bits_dilate(a, b, W, H, w, h, 0);
+                if (status == PGM_OK) status = bits_dilate(a, c, W, H, w, h, 1);
+                job.bits = b;
+                job.minus = c;
+                job.hi -= job.lo;
+                job.lo = 0;
+                break;
+        }
+        if (status == PGM_OK) parallel_rows(0, H, parallel_grain(W, 1), bits_unpack_rows, &job);
+    }
+    buffer_pool_put(a);
+    buffer_pool_put(b);
+    buffer_pool_put(c);
+    return status;
+}
+
+static PgmStatus morphology_framed(const PGMImage* src, PGMImage* dst, PgmMorphOp op, int w, int h) {
+    int allocated;
+    PgmStatus status = prepare_output(src, dst, src->width, src->height, 0, &allocated);
+    if (status != PGM_OK) return status;
+    int lo, hi;
+    if (two_level_image(src, &lo, &hi)) status = morphology_bits(src, dst, op, w, h, lo, hi);
+    else status = morphology_gray(src, dst, op, w, h);
+    return status == PGM_OK ? PGM_OK : fail_output(dst, allocated, status);
+}
+
+PgmStatus pgm_morphology(const PGMImage* src, PGMImage* dst, PgmMorphOp op, int width, int height) {
+    if (!image_is_valid(src) || op < PGM_MORPH_ERODE || op > PGM_MORPH_GRADIENT || width < 1 || height < 1 ||
+        width > PGM_MAX_MORPH_SIZE || height > PGM_MAX_MORPH_SIZE) return PGM_ERR_ARGUMENT;
+    FramedOp framed = { FRAMED_MORPHOLOGY, op, { NULL, NULL }, NULL, 0, { width, height }, NULL };
+    return run_bordered(src, dst, &framed);
+}
+
+
+
+// Connected Components
+// Foreground (non-zero) pixels are grouped into horizontal runs, and runs that touch a
+// run of the row above (in a column for 4-connectivity, also diagonally for 8) are
+// joined with union-find, smaller id as root. Row bands do this on separate threads,
+// then number their components in the order of their first run and sum the area,
+// coordinates and bounding box of each one from its runs, so the statistics come with
+// the labelling and not from another pass over the pixels. The band components are
+// joined across the seams by a second union-find over components, not runs; every
+// component keeps the id of its first band component, so labels count up in raster
+// order of the first pixels whatever the band split. A last parallel pass writes the
+// label image.
+
+typedef struct {
+    uint64_t area, sum_x, sum_y;
+    int x0, y0, x1, y1;
+} ComponentSums;
+
+typedef struct {
+    const PGMImage* img;
+    int y0, y1;
+    int reach;              // columns a diagonal neighbour adds: 1 for 8-connectivity, 0 for 4
+    EdgeRun* runs;
+    int* id;                // union-find parent of every run, then its band component
+    int* row_start;         // runs of row y are [row_start[y - y0], row_start[y - y0 + 1])
+    int count, cap;
+    ComponentSums* sums;    // per band component
+    int components;
+    int offset;             // global id of the first band component
+    const uint32_t* label_of;  // label of every global id (set before the output phase)
+    uint32_t* labels;
+    int ok;
+} ComponentBand;
+
+// joins every run of a with the runs of b it touches; both lists are sorted by column
+// and a_id/b_id are the union-find ids of their first runs
+static void join_component_runs(const EdgeRun* a, int na, int a_id, const EdgeRun* b, int nb, int b_id,
+                                int reach, int* parent) {
+    int k = 0;
+    for (int i = 0; i < na; i++) {
+        while (k < nb && b[k].x1 + reach < a[i].x0) k++;
+        for (int m = k; m < nb && b[m].x0 <= a[i].x1 + reach; m++) {
+            int x = uf_find(parent, a_id + i), y = uf_find(parent, b_id + m);
+            if (x < y) parent[y] = x;
+            else if (y < x) parent[x] = y;
+        }
+    }
+}
+
+static int component_push_run(ComponentBand* b, int x0, int x1) {
+    if (b->count == b->cap) {
+        int cap = b->cap ? b->cap * 2 : 1024;
+        EdgeRun* runs = (EdgeRun*)buffer_pool_grow(b->runs, cap * sizeof(EdgeRun));
+        if (runs == NULL) return 0;
+        b->runs = runs;
+        int* id = (int*)buffer_pool_grow(b->id, cap * sizeof(int));
+        if (id == NULL) return 0;
+        b->id = id;
+        b->cap = cap;
+    }
+    b->runs[b->count].x0 = x0;
+    b->runs[b->count].x1 = x1;
+    b->id[b->count] = b->count;
+    b->count++;
+    return 1;
+}
+
+static inline uint64_t load_u64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static void* component_label_band(void* arg) {
+    ComponentBand* b = (ComponentBand*)arg;
+    int W = b->img->width;
+    b->row_start = (int*)buffer_pool_get((size_t)(b->y1 - b->y0 + 1) * sizeof(int), 0);
+    if (b->row_start == NULL) return NULL;
+    for (int y = b->y0; y < b->y1; y++) {
+        const unsigned char* row = IMG_ROW(b->img, y);
+        int first = b->count;
+        b->row_start[y - b->y0] = first;
+        int x = 0;
+        while (x < W) {
+            // background and foreground stretches 8 pixels at a time (edge maps are mostly 0)
+            while (x + 8 <= W && load_u64(row + x) == 0) x += 8;
+            while (x < W && row[x] == 0) x++;
+            if (x == W) break;
+            int x0 = x;
+            while (x + 8 <= W && zero_byte_mask(load_u64(row + x)) == 0) x += 8;
+            while (x < W && row[x] != 0) x++;
+            if (!component_push_run(b, x0, x - 1)) return NULL;
+        }
+        if (y > b->y0) {
+            int prev = b->row_start[y - 1 - b->y0];
+            join_component_runs(b->runs + first, b->count - first, first, b->runs + prev, first - prev, prev,
+                                b->reach, b->id);
+        }
+    }
+    b->row_start[b->y1 - b->y0] = b->count;
+
+    // parents never point forward, so one pass in run order resolves every run to its
+    // root's component number, and a component first shows up at its root
+    for (int i = 0; i < b->count; i++) b->id[i] = b->id[i] == i ? b->components++ : b->id[b->id[i]];
+    b->sums = (ComponentSums*)buffer_pool_get((size_t)(b->components ? b->components : 1) * sizeof(ComponentSums), 0);
+    if (b->sums == NULL) return NULL;
+    int seen = 0;
+    for (int y = b->y0; y < b->y1; y++) {
+        for (int k = b->row_start[y - b->y0]; k < b->row_start[y - b->y0 + 1]; k++) {
+            const EdgeRun* r = &b->runs[k];
+            ComponentSums* c = &b->sums[b->id[k]];
+            uint64_t len = (uint64_t)(r->x1 - r->x0 + 1);
+            if (b->id[k] == seen) {
+                seen++;
+                *c = (ComponentSums){ 0, 0, 0, r->x0, y, r->x1, y };
+            }
+            c->area += len;
+            c->sum_x += len * (uint64_t)(r->x0 + r->x1) / 2;
+            c->sum_y += len * (uint64_t)y;
+            if (r->x0 < c->x0) c->x0 = r->x0;
+            if (r->x1 > c->x1) c->x1 = r->x1;
+            c->y1 = y;
+        }
+    }
+    b->ok = 1;
+    return NULL;
+}
+
+static void* component_write_band(void* arg) {
+    ComponentBand* b = (ComponentBand*)arg;
+    int W = b->img->width;
+    for (int y = b->y0; y < b->y1; y++) {
+        uint32_t* out = b->labels + (size_t)y * W;
+        memset(out, 0, (size_t)W * sizeof(uint32_t));
+        for (int k = b->row_start[y - b->y0]; k < b->row_start[y - b->y0 + 1]; k++) {
+            uint32_t label = b->label_of[b->offset + b->id[k]];
+            for (int x = b->runs[k].x0; x <= b->runs[k].x1; x++) out[x] = label;
+        }
+    }
+    return NULL;
+}
+
+// components of the band split joined into labels[] and the table; returns the status
+static PgmStatus merge_component_bands(ComponentBand* bands, int nbands, PgmLabels* out) {
+    int total = 0;
+    for (int k = 0; k < nbands; k++) {
+        bands[k].offset = total;
+        total += bands[k].components;
+    }
+    int* parent = (int*)buffer_pool_get((size_t)(total ? total : 1) * sizeof(int), 0);
+    uint32_t* label_of = (uint32_t*)buffer_pool_get((size_t)(total ? total : 1) * sizeof(uint32_t), 0);
+    ComponentSums* sums = (ComponentSums*)buffer_pool_get((size_t)(total ? total : 1) * sizeof(ComponentSums), 0);
+    if (parent == NULL || label_of == NULL || sums == NULL) {
+        buffer_pool_put(parent);
+        buffer_pool_put(label_of);
+        buffer_pool_put(sums);
+        return PGM_ERR_NOMEM;
+    }
+    for (int i = 0; i < total; i++) parent[i] = i;
+
+    // the last row of every band against the first row of the next, by component
+    for (int k = 0; k + 1 < nbands; k++) {
+        const ComponentBand* up = &bands[k];
+        const ComponentBand* down = &bands[k + 1];
+        int last = up->y1 - 1 - up->y0;
+        int a0 = up->row_start[last], na = up->row_start[last + 1] - a0, nb = down->row_start[1];
+        int m0 = 0;
+        for (int i = 0; i < na; i++) {
+            const EdgeRun* a = &up->runs[a0 + i];
+            while (m0 < nb && down->runs[m0].x1 + up->reach < a->x0) m0++;
+            for (int m = m0; m < nb && down->runs[m].x0 <= a->x1 + up->reach; m++) {
+                int x = uf_find(parent, up->offset + up->id[a0 + i]);
+                int y = uf_find(parent, down->offset + down->id[m]);
+                if (x < y) parent[y] = x;
+                else if (y < x) parent[x] = y;
+            }
+        }
+    }
+
+    // roots come first again: number them in order and add up their members
+    uint32_t count = 0;
+    for (int k = 0; k < nbands; k++) {
+        for (int c = 0; c < bands[k].components; c++) {
+            int i = bands[k].offset + c;
+            parent[i] = parent[parent[i]];
+            const ComponentSums* part = &bands[k].sums[c];
+            if (parent[i] == i) {
+                label_of[i] = ++count;
+                sums[count - 1] = *part;
+                continue;
+            }
+            label_of[i] = label_of[parent[i]];
+            ComponentSums* s = &sums[label_of[i] - 1];
+            s->area += part->area;
+            s->sum_x += part->sum_x;
+            s->sum_y += part->sum_y;
+            if (part->x0 < s->x0) s->x0 = part->x0;
+            if (part->x1 > s->x1) s->x1 = part->x1;
+            if (part->y1 > s->y1) s->y1 = part->y1;
+        }
+    }
+    buffer_pool_put(parent);
+
+    // the table reuses the sums: a PgmComponent is no larger than the ComponentSums it replaces
+    _Static_assert(sizeof(PgmComponent) <= sizeof(ComponentSums), "PgmComponent outgrew ComponentSums");
+    PgmComponent* table = (PgmComponent*)sums;
+    for (uint32_t k = 0; k < count; k++) {
+        ComponentSums s = sums[k];
+        table[k].area = s.area;
+        table[k].x0 = s.x0;
+        table[k].y0 = s.y0;
+        table[k].x1 = s.x1;
+        table[k].y1 = s.y1;
+        table[k].cx = (double)s.sum_x / (double)s.area;
+        table[k].cy = (double)s.sum_y / (double)s.area;
+    }
+    for (int k = 0; k < nbands; k++) bands[k].label_of = label_of;
+    run_bands(bands, nbands, sizeof(bands[0]), component_write_band);
+    buffer_pool_put(label_of);
+    out->count = count;
+    out->components = table;
+    return PGM_OK;
+}
+
+PgmStatus pgm_label_components(const PGMImage* src, int connectivity, PgmLabels* out) {
+    if (out != NULL) memset(out, 0, sizeof(*out));
+    if (!image_is_valid(src) || out == NULL || (connectivity != 4 && connectivity != 8)) return PGM_ERR_ARGUMENT;
+    int W = src->width, H = src->height;
+    uint32_t* labels = (uint32_t*)buffer_pool_get((size_t)W * H * sizeof(uint32_t), 0);
+    if (labels == NULL) return PGM_ERR_NOMEM;
+
+    // deterministic bands of at least 64 rows, one per worker
+    int nbands = worker_thread_count();
+    if (nbands > H / 64) nbands = H / 64;
+    if (nbands < 1) nbands = 1;
+    ComponentBand bands[MAX_WORKER_THREADS];
+    memset(bands, 0, sizeof(bands));
+    for (int k = 0; k < nbands; k++) {
+        bands[k].img = src;
+        bands[k].y0 = (int)((long)H * k / nbands);
+        bands[k].y1 = (int)((long)H * (k + 1) / nbands);
+        bands[k].reach = connectivity == 8 ? 1 : 0;
+        bands[k].labels = labels;
+    }
+    run_bands(bands, nbands, sizeof(bands[0]), component_label_band);
+
+    PgmStatus status = PGM_OK;
+    for (int k = 0; k < nbands; k++) {
+        if (!bands[k].ok) status = PGM_ERR_NOMEM;
+    }
+    if (status == PGM_OK) status = merge_component_bands(bands, nbands, out);
+    for (int k = 0; k < nbands; k++) {
+        buffer_pool_put(bands[k].runs);
+        buffer_pool_put(bands[k].id);
+        buffer_pool_put(bands[k].row_start);
+        buffer_pool_put(bands[k].sums);
+    }
+    if (status != PGM_OK) {
+        buffer_pool_put(labels);
+        return status;
+    }
+    out->width = W;
+    out->height = H;
+    out->labels = labels;
+    return PGM_OK;
+}
+
+void pgm_labels_free(PgmLabels* labels) {
+    if (labels == NULL) return;
+    buffer_pool_put(labels->labels);
+    buffer_pool_put(labels->components);
+    memset(labels, 0, sizeof(*labels));
+}
+
+// decimal digits of v at p, returns the end
+static char* put_decimal(char* p, uint64_t v) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    while (n > 0) *p++ = digits[--n];
+    return p;
+}
+
+// v >= 0 with three decimals
+static char* put_fixed3(char* p, double v) {
+    uint64_t milli = (uint64_t)(v * 1000 + 0.5);
+    p = put_decimal(p, milli / 1000);
+    *p++ = '.';
+    *p++ = (char)('0' + milli / 100 % 10);
+    *p++ = (char)('0' + milli / 10 % 10);
+    *p++ = (char)('0' + milli % 10);
+    return p;
+}
+
+// Component table as CSV: a header line, then one line per label. Lines are formatted
+// by hand into a block buffer, printf would take most of the time for millions of rows.
+#define CSV_BLOCK 65536
+#define CSV_MAX_LINE 160
+
+PgmStatus pgm_save_components(const PgmLabels* labels, const char* path) {
+    if (labels == NULL || path == NULL || (labels->count > 0 && labels->components == NULL)) return PGM_ERR_ARGUMENT;
+    char* block = (char*)buffer_pool_get(CSV_BLOCK, 0);
+    if (block == NULL) return PGM_ERR_NOMEM;
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        buffer_pool_put(block);
+        return PGM_ERR_IO;
+    }
+    static const char header[] = "label,area,x0,y0,x1,y1,cx,cy\n";
+    memcpy(block, header, sizeof(header) - 1);
+    char* p = block + sizeof(header) - 1;
+    int ok = 1;
+    for (uint32_t k = 0; ok && k < labels->count; k++) {
+        const PgmComponent* c = &labels->components[k];
+        p = put_decimal(p, k + 1);
+        *p++ = ',';
+        p = put_decimal(p, c->area);
+        int box[4] = { c->x0, c->y0, c->x1, c->y1 };
+        for (int i = 0; i < 4; i++) {
+            *p++ = ',';
+            p = put_decimal(p, (uint64_t)box[i]);
+        }
+        *p++ = ',';
+        p = put_fixed3(p, c->cx);
+        *p++ = ',';
+        p = put_fixed3(p, c->cy);
+        *p++ = '\n';
+        if (p - block > CSV_BLOCK - CSV_MAX_LINE) {
+            ok = fwrite(block, 1, p - block, fp) == (size_t)(p - block);
+            p = block;
+        }
+    }
+    if (ok && p > block) ok = fwrite(block, 1, p - block, fp) == (size_t)(p - block);
+    buffer_pool_put(block);
+    ok = fclose(fp) == 0 && ok;
+    return ok ? PGM_OK : PGM_ERR_IO;
+}
+
+
+
+// Border Modes
+// On a source with a border mode, an operator with radius r (rx, ry) fills rx columns and
+// ry rows of the guard band around its source from the image, then runs its usual
+// kernel on the (W + 2rx) x (H + 2ry) view that includes the band, into the same view
+// of the result. The frame the kernel cannot cover falls into the result's band, so
+// every image pixel gets a full window and the kernels need no border code. A source
+// with a band that wide is filled in place (the band is scratch, not image content),
+// others are copied into a padded buffer first; a result without a band that wide is
+// produced in a padded buffer and copied.
+
+// image index that the out of range position i (of n) reads in the mode
+static int border_index(int i, int n, PgmBorderMode mode) {
+    if (mode == PGM_BORDER_REFLECT) {
+        if (n == 1) return 0;
+        int period = 2 * n - 2;
+        i %= period;
+        if (i < 0) i += period;
+        return i < n ? i : period - i;
+    }
+    if (mode == PGM_BORDER_WRAP) {
+        i %= n;
+        return i < 0 ? i + n : i;
+    }
+    return i < 0 ? 0 : n - 1;
+}
+
+// fills rx columns on either side of every row, then ry whole rows (corners included)
+// above and below them
+static void fill_guard_band(const PGMImage* img, int rx, int ry, PgmBorderMode mode, int value) {
+    int W = img->width, H = img->height;
+    for (int i = 0; i < H && rx > 0; i++) {
+        unsigned char* row = IMG_ROW(img, i);
+        if (mode == PGM_BORDER_CONSTANT || mode == PGM_BORDER_REPLICATE) {
+            memset(row - rx, mode == PGM_BORDER_CONSTANT ? value : row[0], rx);
+            memset(row + W, mode == PGM_BORDER_CONSTANT ? value : row[W - 1], rx);
+            continue;
+        }
+        for (int j = 1; j <= rx; j++) {
+            row[-j] = row[border_index(-j, W, mode)];
+            row[W - 1 + j] = row[border_index(W - 1 + j, W, mode)];
+        }
+    }
+    size_t len = (size_t)W + 2 * rx;
+    for (int k = 1; k <= ry; k++) {
+        unsigned char* above = img->data - (size_t)k * img->stride - rx;
+        unsigned char* below = IMG_ROW(img, H - 1 + k) - rx;
+        if (mode == PGM_BORDER_CONSTANT) {
+            memset(above, value, len);
+            memset(below, value, len);
+        } else {
+            memcpy(above, IMG_ROW(img, border_index(-k, H, mode)) - rx, len);
+            memcpy(below, IMG_ROW(img, border_index(H - 1 + k, H, mode)) - rx, len);
+        }
+    }
+}
+
+// view of the image extended by rx columns and ry rows of its guard band
+static PgmStatus extended_view(const PGMImage* img, int rx, int ry, PGMImage* view) {
+    unsigned char* data = img->data - (size_t)ry * img->stride - rx;
+    PgmStatus status = pgm_image_wrap(view, data, img->width + 2 * rx, img->height + 2 * ry, img->stride);
+    view->max_val = img->max_val;
+    return status;
+}
+
+static void framed_radius(const FramedOp* op, int* rx, int* ry) {
+    switch (op->kind) {
+        case FRAMED_CONVOLVE:
+        case FRAMED_GRADIENT:
+            *rx = op->kernel[0]->width / 2;
+            *ry = op->kernel[0]->height / 2;
+            return;
+        case FRAMED_MEAN:
+        case FRAMED_MEDIAN:
+            *rx = *ry = op->n;
+            return;
+        case FRAMED_LBP:
+            *rx = *ry = 1;
+            return;
+        case FRAMED_CANNY_SUPPRESS:
+            *rx = *ry = 4;  // 2 blur, 1 gradient, 1 suppression
+            return;
+        case FRAMED_CANNY:
+            *rx = *ry = 5;  // and one more for the hysteresis ring
+            return;
+        case FRAMED_MORPHOLOGY:
+            // opening and closing run their second pass on the first one's band
+            *rx = op->size[0] / 2 * (op->n == PGM_MORPH_OPEN || op->n == PGM_MORPH_CLOSE ? 2 : 1);
+            *ry = op->size[1] / 2 * (op->n == PGM_MORPH_OPEN || op->n == PGM_MORPH_CLOSE ? 2 : 1);
+            return;
+    }
+    *rx = *ry = 0;
+}
+
+// the operator on exactly the pixels of src, leaving its frame as without a border mode
+static PgmStatus run_framed(const PGMImage* src, PGMImage* dst, const FramedOp* op) {
+    switch (op->kind) {
+        case FRAMED_CONVOLVE:       return convolve_framed(src, dst, op->kernel[0]);
+        case FRAMED_GRADIENT:       return gradient_framed(src, dst, op->kernel[0], op->kernel[1]);
+        case FRAMED_MEAN:           return op->n == 1 ? average_filter(src, dst) : box_filter(src, dst, op->n);
+        case FRAMED_MEDIAN:         return op->n == 1 ? median_filter(src, dst) : median_filter_ctmf(src, dst, op->n);
+        case FRAMED_LBP:            return lbp_framed(src, dst, (LbpMapping)op->n);
+        case FRAMED_CANNY_SUPPRESS: return canny_suppress_framed(src, dst, op->n, op->hist, op->hist_inset);
+        case FRAMED_CANNY:          return canny_framed(src, dst, op->n, op->thresholds);
+        case FRAMED_MORPHOLOGY:     return morphology_framed(src, dst, (PgmMorphOp)op->n, op->size[0], op->size[1]);
+    }
+    return PGM_ERR_ARGUMENT;
+}
+
+static PgmStatus run_bordered(const PGMImage* src, PGMImage* dst, const FramedOp* op) {
+    PgmBorderMode mode = src->border;
+    if (mode == PGM_BORDER_NONE) return run_framed(src, dst, op);
+    if (dst == NULL) return PGM_ERR_ARGUMENT;
+    int W = src->width, H = src->height;
+    int rx, ry;
+    framed_radius(op, &rx, &ry);
+    int r = rx > ry ? rx : ry;
+    int pad = r > PGM_GUARD_BAND ? r : PGM_GUARD_BAND;
+
+    int allocated = dst->pixels == NULL;
+    if (!allocated && (dst->width != W || dst->height != H || dst->map_base != NULL || dst->data == src->data)) {
+        return PGM_ERR_ARGUMENT;
+    }
+    PGMImage padded_src = {0}, padded_dst = {0};
+    const PGMImage* s = src;
+    PGMImage* d = dst;
+    if (src->pad < r) {
+        if (!alloc_padded_buffer(&padded_src, W, H, pad, 0)) return PGM_ERR_NOMEM;
+        padded_src.max_val = src->max_val;
+        copy_pixels(src, &padded_src);
+        s = &padded_src;
+    }
+    if (!allocated && dst->pad < r) d = &padded_dst;
+    if ((allocated || d != dst) && !alloc_padded_buffer(d, W, H, pad, 0)) {
+        free_image_memory(&padded_src);
+        return PGM_ERR_NOMEM;
+    }
+    fill_guard_band(s, rx, ry, mode, src->border_value);
+
+    // Canny suppresses one pixel beyond the image, so hysteresis can track along the edge;
+    // the thresholds come from the pixels it sees
+    uint64_t hist[256];
+    FramedOp framed = *op;
+    if (op->kind == FRAMED_CANNY) {
+        framed.kind = FRAMED_CANNY_SUPPRESS;
+        framed.hist = hist;
+        framed.hist_inset = r - 1;
+    }
+    PGMImage src_view = {0}, dst_view = {0};
+    PgmStatus status = extended_view(s, rx, ry, &src_view);
+    if (status == PGM_OK) status = extended_view(d, rx, ry, &dst_view);
+    if (status == PGM_OK) status = run_framed(&src_view, &dst_view, &framed);
+    free_image_memory(&dst_view);
+    if (status == PGM_OK && op->kind == FRAMED_CANNY) {
+        status = extended_view(d, 1, 1, &dst_view);
+        if (status == PGM_OK) status = hysteresis_with_histogram(&dst_view, hist, op->thresholds);
+        free_image_memory(&dst_view);
+    }
+    free_image_memory(&src_view);
+    free_image_memory(&padded_src);
+
+    if (status == PGM_OK) {
+        d->max_val = src->max_val;
+        if (d != dst) copy_pixels(d, dst);
+        dst->max_val = src->max_val;
+        dst->border = src->border;
+        dst->border_value = src->border_value;
+    }
+    free_image_memory(&padded_dst);
+    return status == PGM_OK ? PGM_OK : fail_output(dst, allocated, status);
+}
+
+// SIMD Stencil Kernels and CPU Dispatch
+// SSE2 (16 px), AVX2 (32 px) and AVX-512BW (64 px) versions of the 3x3 row kernels.
+// The 3x3 median runs a min/max sorting network on whole vectors.
+// Sums are kept in 16-bit lanes (at most 9 * 255), the division by 9 of the average
+// filter is a multiply-high by ceil(2^16 / 9), exact for every possible sum.
+// The columns left over at the end of a row go through the scalar reference.
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define AVG9_RECIPROCAL 7282
+
+// 19 compare-exchange median-of-9 network, leaves the median of p[0..8] in p[4]
+// (SORT2(a, b) must put min(a, b) in a and max(a, b) in b)
+#define MEDIAN9_NETWORK(SORT2, p)                                         \
+    SORT2(p[1], p[2]); SORT2(p[4], p[5]); SORT2(p[7], p[8]);              \
+    SORT2(p[0], p[1]); SORT2(p[3], p[4]); SORT2(p[6], p[7]);              \
+    SORT2(p[1], p[2]); SORT2(p[4], p[5]); SORT2(p[7], p[8]);              \
+    SORT2(p[0], p[3]); SORT2(p[5], p[8]); SORT2(p[4], p[7]);              \
+    SORT2(p[3], p[6]); SORT2(p[1], p[4]); SORT2(p[2], p[5]);              \
+    SORT2(p[4], p[7]); SORT2(p[4], p[2]); SORT2(p[6], p[4]);              \
+    SORT2(p[4], p[2])
+
+// the 3x3 neighbourhood of 'lanes' pixels starting at out[j], row by row
+#define LOAD_NEIGHBOURHOOD(p, LOAD)                                                   \
+    p[0] = LOAD(rows[0] + j - 1); p[1] = LOAD(rows[0] + j); p[2] = LOAD(rows[0] + j + 1); \
+    p[3] = LOAD(rows[1] + j - 1); p[4] = LOAD(rows[1] + j); p[5] = LOAD(rows[1] + j + 1); \
+    p[6] = LOAD(rows[2] + j - 1); p[7] = LOAD(rows[2] + j); p[8] = LOAD(rows[2] + j + 1)
+
+// the nine neighbours of 16 output pixels, as 8 x u16 halves (h = 0 low, 1 high)
+#define SSE2_NEIGHBOURS(h)                                                        \
+    __m128i t0 = sse2_widen(rows[0] + j - 1, h), t1 = sse2_widen(rows[0] + j, h), \
+            t2 = sse2_widen(rows[0] + j + 1, h);                                  \
+    __m128i m0 = sse2_widen(rows[1] + j - 1, h), m1 = sse2_widen(rows[1] + j, h), \
+            m2 = sse2_widen(rows[1] + j + 1, h);                                  \
+    __m128i b0 = sse2_widen(rows[2] + j - 1, h), b1 = sse2_widen(rows[2] + j, h), \
+            b2 = sse2_widen(rows[2] + j + 1, h);                                  \
+    (void)m1
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_widen(const unsigned char* p, int h) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    return h ? _mm_unpackhi_epi8(v, _mm_setzero_si128()) : _mm_unpacklo_epi8(v, _mm_setzero_si128());
+}
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_abs16(__m128i v) {
+    return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+__attribute__((target("sse2")))
+static void average_row_sse2(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {
+    const __m128i recip = _mm_set1_epi16(AVG9_RECIPROCAL);
+    int j = j0;
+    for (; j + 16 <= j1; j += 16) {
+        __m128i res[2];
+        for (int h = 0; h < 2; h++) {
+            SSE2_NEIGHBOURS(h);
+            __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(t0, t1), _mm_add_epi16(t2, m0)),
+                                        _mm_add_epi16(_mm_add_epi16(m1, m2), _mm_add_epi16(b0, b1)));
+            sum = _mm_add_epi16(sum, b2);
+            res[h] = _mm_mulhi_epu16(sum, recip);
+        }
+        _mm_storeu_si128((__m128i*)(out + j), _mm_packus_epi16(res[0], res[1]));
+    }
+    average_row_scalar(rows, out, j, j1);
+}
+
+// Sobel (center weight 2) and Prewitt (center weight 1) share one body
+#define SSE2_GRADIENT_ROW(NAME, CENTER_SHIFT, TAIL)                                                \
+__attribute__((target("sse2")))                                                                    \
+static void NAME(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {        \
+    int j = j0;                                                                                    \
+    for (; j + 16 <= j1; j += 16) {                                                                \
+        __m128i res[2];                                                                            \
+        for (int h = 0; h < 2; h++) {                                                              \
+            SSE2_NEIGHBOURS(h);                                                                    \
+            __m128i gx = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(t2, t0), _mm_sub_epi16(b2, b0)), \
+                                       _mm_slli_epi16(_mm_sub_epi16(m2, m0), CENTER_SHIFT));       \
+            __m128i gy = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(b0, t0), _mm_sub_epi16(b2, t2)), \
+                                       _mm_slli_epi16(_mm_sub_epi16(b1, t1), CENTER_SHIFT));       \
+            res[h] = _mm_add_epi16(sse2_abs16(gx), sse2_abs16(gy));                                \
+        }                                                                                          \
+        _mm_storeu_si128((__m128i*)(out + j), _mm_packus_epi16(res[0], res[1]));                   \
+    }                                                                                              \
+    TAIL(rows, out, j, j1);                                                                        \
+}
+
+SSE2_GRADIENT_ROW(sobel_row_sse2, 1, sobel_row_scalar)
+SSE2_GRADIENT_ROW(prewitt_row_sse2, 0, prewitt_row_scalar)
+
+// neighbour >= center as a byte mask, unsigned compare through max
+#define SSE2_GE_U8(n, c) _mm_cmpeq_epi8(_mm_max_epu8((n), (c)), (n))
+
+__attribute__((target("sse2")))
+static void lbp_row_sse2(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {
+    int j = j0;
+    for (; j + 16 <= j1; j += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(rows[1] + j));
+        __m128i code = _mm_and_si128(SSE2_GE_U8(_mm_loadu_si128((const __m128i*)(rows[0] + j - 1)), c), _mm_set1_epi8((char)0x80));
+        code = _mm_or_si128(code, _mm_and_si128(SSE2_GE_U8(_mm_loadu_si128((const __m128i*)(rows[0] + j)), c), _mm_set1_epi8(0x40)));
+        code = _mm_or_si128(code, _mm_and_si128(SSE2_GE_U8(_mm_loadu_si128((const __m128i*)(rows[0] + j + 1)), c), _mm_set1_epi8(0x20)));
+        code = _mm_or_si128(code, _mm_and_si128(SSE2_GE_U8(_mm_loadu_si128((const __m128i*)(rows[1] + j + 1)), c), _mm_set1_epi8(0x10)));
+        code = _mm_or_si128(code, _mm_and_si128(SSE2_GE_U8(_mm_loadu_si128((const __m128i*)(rows[2] + j + 1)), c), _mm_set1_epi8(0x08)));
+        code = _mm_or_si128(code, _mm_and_si128(SSE2_GE_U8(_mm_loadu_si128((const __m128i*)(rows[2] + j)), c), _mm_set1_epi8(0x04)));
+        code = _mm_or_si128(code, _mm_and_si128(SSE2_GE_U8(_mm_loadu_si128((const __m128i*)(rows[2] + j - 1)), c), _mm_set1_epi8(0x02)));
+        code = _mm_or_si128(code, _mm_and_si128(SSE2_GE_U8(_mm_loadu_si128((const __m128i*)(rows[1] + j - 1)), c), _mm_set1_epi8(0x01)));
+        _mm_storeu_si128((__m128i*)(out + j), code);
+    }
+    lbp_row_scalar(rows, out, j, j1);
+}
+
+#define SSE2_LOAD(ptr) _mm_loadu_si128((const __m128i*)(ptr))
+#define SSE2_SORT2(a, b) do { __m128i t_ = _mm_min_epu8(a, b); b = _mm_max_epu8(a, b); a = t_; } while (0)
+
+__attribute__((target("sse2")))
+static void median_row_sse2(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {
+    int j = j0;
+    for (; j + 16 <= j1; j += 16) {
+        __m128i p[9];
+        LOAD_NEIGHBOURHOOD(p, SSE2_LOAD);
+        MEDIAN9_NETWORK(SSE2_SORT2, p);
+        _mm_storeu_si128((__m128i*)(out + j), p[4]);
+    }
+    median_row_scalar(rows, out, j, j1);
+}
+
+// AVX2: 32 pixels, widened as two 16 x u16 halves; packus works per 128-bit lane
+// so the packed result is put back in order with a 64-bit permute
+#define AVX2_NEIGHBOURS(h)                                                        \
+    __m256i t0 = avx2_widen(rows[0] + j - 1, h), t1 = avx2_widen(rows[0] + j, h), \
+            t2 = avx2_widen(rows[0] + j + 1, h);                                  \
+    __m256i m0 = avx2_widen(rows[1] + j - 1, h), m1 = avx2_widen(rows[1] + j, h), \
+            m2 = avx2_widen(rows[1] + j + 1, h);                                  \
+    __m256i b0 = avx2_widen(rows[2] + j - 1, h), b1 = avx2_widen(rows[2] + j, h), \
+            b2 = avx2_widen(rows[2] + j + 1, h);                                  \
+    (void)m1
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_widen(const unsigned char* p, int h) {
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(p + 16 * h)));
+}
+
+__attribute__((target("avx2")))
+static inline void avx2_store_packed(unsigned char* out, __m256i lo, __m256i hi) {
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8);
+    _mm256_storeu_si256((__m256i*)out, packed);
+}
+
+__attribute__((target("avx2")))
+static void average_row_avx2(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {
+    const __m256i recip = _mm256_set1_epi16(AVG9_RECIPROCAL);
+    int j = j0;
+    for (; j + 32 <= j1; j += 32) {
+        __m256i res[2];
+        for (int h = 0; h < 2; h++) {
+            AVX2_NEIGHBOURS(h);
+            __m256i sum = _mm256_add_epi16(_mm256_add_epi16(_mm256_add_epi16(t0, t1), _mm256_add_epi16(t2, m0)),
+                                           _mm256_add_epi16(_mm256_add_epi16(m1, m2), _mm256_add_epi16(b0, b1)));
+            sum = _mm256_add_epi16(sum, b2);
+            res[h] = _mm256_mulhi_epu16(sum, recip);
+        }
+        avx2_store_packed(out + j, res[0], res[1]);
+    }
+    average_row_sse2(rows, out, j, j1);
+}
+
+#define AVX2_GRADIENT_ROW(NAME, CENTER_SHIFT, TAIL)                                                         \
+__attribute__((target("avx2")))                                                                             \
+static void NAME(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {                 \
+    int j = j0;                                                                                             \
+    for (; j + 32 <= j1; j += 32) {                                                                         \
+        __m256i res[2];                                                                                     \
+        for (int h = 0; h < 2; h++) {                                                                       \
+            AVX2_NEIGHBOURS(h);                                                                             \
+            __m256i gx = _mm256_add_epi16(_mm256_add_epi16(_mm256_sub_epi16(t2, t0), _mm256_sub_epi16(b2, b0)), \
+                                          _mm256_slli_epi16(_mm256_sub_epi16(m2, m0), CENTER_SHIFT));       \
+            __m256i gy = _mm256_add_epi16(_mm256_add_epi16(_mm256_sub_epi16(b0, t0), _mm256_sub_epi16(b2, t2)), \
+                                          _mm256_slli_epi16(_mm256_sub_epi16(b1, t1), CENTER_SHIFT));       \
+            res[h] = _mm256_add_epi16(_mm256_abs_epi16(gx), _mm256_abs_epi16(gy));                          \
+        }                                                                                                   \
+        avx2_store_packed(out + j, res[0], res[1]);                                                         \
+    }                                                                                                       \
+    TAIL(rows, out, j, j1);                                                                                 \
+}
+
+AVX2_GRADIENT_ROW(sobel_row_avx2, 1, sobel_row_sse2)
+AVX2_GRADIENT_ROW(prewitt_row_avx2, 0, prewitt_row_sse2)
+
+#define AVX2_GE_U8(n, c) _mm256_cmpeq_epi8(_mm256_max_epu8((n), (c)), (n))
+#define AVX2_LBP_BIT(row, dj, bit) \
+    _mm256_and_si256(AVX2_GE_U8(_mm256_loadu_si256((const __m256i*)(rows[row] + j + (dj))), c), _mm256_set1_epi8((char)(bit)))
+
+__attribute__((target("avx2")))
+static void lbp_row_avx2(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {
+    int j = j0;
+    for (; j + 32 <= j1; j += 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)(rows[1] + j));
+        __m256i code = _mm256_or_si256(AVX2_LBP_BIT(0, -1, 0x80), AVX2_LBP_BIT(0, 0, 0x40));
+        code = _mm256_or_si256(code, _mm256_or_si256(AVX2_LBP_BIT(0, 1, 0x20), AVX2_LBP_BIT(1, 1, 0x10)));
+        code = _mm256_or_si256(code, _mm256_or_si256(AVX2_LBP_BIT(2, 1, 0x08), AVX2_LBP_BIT(2, 0, 0x04)));
+        code = _mm256_or_si256(code, _mm256_or_si256(AVX2_LBP_BIT(2, -1, 0x02), AVX2_LBP_BIT(1, -1, 0x01)));
+        _mm256_storeu_si256((__m256i*)(out + j), code);
+    }
+    lbp_row_sse2(rows, out, j, j1);
+}
+
+#define AVX2_LOAD(ptr) _mm256_loadu_si256((const __m256i*)(ptr))
+#define AVX2_SORT2(a, b) do { __m256i t_ = _mm256_min_epu8(a, b); b = _mm256_max_epu8(a, b); a = t_; } while (0)
+
+__attribute__((target("avx2")))
+static void median_row_avx2(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {
+    int j = j0;
+    for (; j + 32 <= j1; j += 32) {
+        __m256i p[9];
+        LOAD_NEIGHBOURHOOD(p, AVX2_LOAD);
+        MEDIAN9_NETWORK(AVX2_SORT2, p);
+        _mm256_storeu_si256((__m256i*)(out + j), p[4]);
+    }
+    median_row_sse2(rows, out, j, j1);
+}
+
+// 32-bit lane products need SSE4.1 (pmulld), so the SSE2 level uses the scalar pass
+__attribute__((target("avx2")))
+static void resample_rows_avx2(const uint32_t* const* rows, const uint32_t* weights, int taps,
+                               unsigned char* out, int j0, int j1) {
+    const __m256i round = _mm256_set1_epi32(1 << (RESAMPLE_OUT_SHIFT - 1));
+    int x = j0;
+    for (; x + 8 <= j1; x += 8) {
+        __m256i acc = round;
+        for (int t = 0; t < taps; t++) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(rows[t] + x));
+            acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(v, _mm256_set1_epi32((int)weights[t])));
+        }
+        acc = _mm256_srli_epi32(acc, RESAMPLE_OUT_SHIFT);
+        __m128i w16 = _mm_packus_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        _mm_storel_epi64((__m128i*)(out + x), _mm_packus_epi16(w16, w16));
+    }
+    resample_rows_scalar(rows, weights, taps, out, x, j1);
+}
+
+// AVX-512BW: 64 pixels, two 32 x u16 halves narrowed back with (saturating) converts
+#define AVX512_NEIGHBOURS(h)                                                          \
+    __m512i t0 = avx512_widen(rows[0] + j - 1, h), t1 = avx512_widen(rows[0] + j, h), \
+            t2 = avx512_widen(rows[0] + j + 1, h);                                    \
+    __m512i m0 = avx512_widen(rows[1] + j - 1, h), m1 = avx512_widen(rows[1] + j, h), \
+            m2 = avx512_widen(rows[1] + j + 1, h);                                    \
+    __m512i b0 = avx512_widen(rows[2] + j - 1, h), b1 = avx512_widen(rows[2] + j, h), \
+            b2 = avx512_widen(rows[2] + j + 1, h);                                    \
+    (void)m1
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i avx512_widen(const unsigned char* p, int h) {
+    return _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(p + 32 * h)));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void average_row_avx512(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {
+    const __m512i recip = _mm512_set1_epi16(AVG9_RECIPROCAL);
+    int j = j0;
+    for (; j + 64 <= j1; j += 64) {
+        for (int h = 0; h < 2; h++) {
+            AVX512_NEIGHBOURS(h);
+            __m512i sum = _mm512_add_epi16(_mm512_add_epi16(_mm512_add_epi16(t0, t1), _mm512_add_epi16(t2, m0)),
+                                           _mm512_add_epi16(_mm512_add_epi16(m1, m2), _mm512_add_epi16(b0, b1)));
+            sum = _mm512_add_epi16(sum, b2);
+            _mm256_storeu_si256((__m256i*)(out + j + 32 * h), _mm512_cvtepi16_epi8(_mm512_mulhi_epu16(sum, recip)));
+        }
+    }
+    average_row_avx2(rows, out, j, j1);
+}
+
+#define AVX512_GRADIENT_ROW(NAME, CENTER_SHIFT, TAIL)                                                       \
+__attribute__((target("avx512f,avx512bw")))                                                                 \
+static void NAME(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {                 \
+    int j = j0;                                                                                             \
+    for (; j + 64 <= j1; j += 64) {                                                                         \
+        for (int h = 0; h < 2; h++) {                                                                       \
+            AVX512_NEIGHBOURS(h);                                                                           \
+            __m512i gx = _mm512_add_epi16(_mm512_add_epi16(_mm512_sub_epi16(t2, t0), _mm512_sub_epi16(b2, b0)), \
+                                          _mm512_slli_epi16(_mm512_sub_epi16(m2, m0), CENTER_SHIFT));       \
+            __m512i gy = _mm512_add_epi16(_mm512_add_epi16(_mm512_sub_epi16(b0, t0), _mm512_sub_epi16(b2, t2)), \
+                                          _mm512_slli_epi16(_mm512_sub_epi16(b1, t1), CENTER_SHIFT));       \
+            __m512i mag = _mm512_add_epi16(_mm512_abs_epi16(gx), _mm512_abs_epi16(gy));                     \
+            _mm256_storeu_si256((__m256i*)(out + j + 32 * h), _mm512_cvtusepi16_epi8(mag));                 \
+        }                                                                                                   \
+    }                                                                                                       \
+    TAIL(rows, out, j, j1);                                                                                 \
+}
+
+AVX512_GRADIENT_ROW(sobel_row_avx512, 1, sobel_row_avx2)
+AVX512_GRADIENT_ROW(prewitt_row_avx512, 0, prewitt_row_avx2)
+
+#define AVX512_LBP_BIT(row, dj, bit) \
+    _mm512_maskz_mov_epi8(_mm512_cmpge_epu8_mask(_mm512_loadu_si512((const void*)(rows[row] + j + (dj))), c), _mm512_set1_epi8((char)(bit)))
+
+__attribute__((target("avx512f,avx512bw")))
+static void lbp_row_avx512(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {
+    int j = j0;
+    for (; j + 64 <= j1; j += 64) {
+        __m512i c = _mm512_loadu_si512((const void*)(rows[1] + j));
+        __m512i code = _mm512_or_si512(AVX512_LBP_BIT(0, -1, 0x80), AVX512_LBP_BIT(0, 0, 0x40));
+        code = _mm512_or_si512(code, _mm512_or_si512(AVX512_LBP_BIT(0, 1, 0x20), AVX512_LBP_BIT(1, 1, 0x10)));
+        code = _mm512_or_si512(code, _mm512_or_si512(AVX512_LBP_BIT(2, 1, 0x08), AVX512_LBP_BIT(2, 0, 0x04)));
+        code = _mm512_or_si512(code, _mm512_or_si512(AVX512_LBP_BIT(2, -1, 0x02), AVX512_LBP_BIT(1, -1, 0x01)));
+        _mm512_storeu_si512((void*)(out + j), code);
+    }
+    lbp_row_avx2(rows, out, j, j1);
+}
+
+#define AVX512_LOAD(ptr) _mm512_loadu_si512((const void*)(ptr))
+#define AVX512_SORT2(a, b) do { __m512i t_ = _mm512_min_epu8(a, b); b = _mm512_max_epu8(a, b); a = t_; } while (0)
+
+__attribute__((target("avx512f,avx512bw")))
+static void median_row_avx512(const unsigned char* const rows[3], unsigned char* out, int j0, int j1) {
+    int j = j0;
+    for (; j + 64 <= j1; j += 64) {
+        __m512i p[9];
+        LOAD_NEIGHBOURHOOD(p, AVX512_LOAD);
+        MEDIAN9_NETWORK(AVX512_SORT2, p);
+        _mm512_storeu_si512((void*)(out + j), p[4]);
+    }
+    median_row_avx2(rows, out, j, j1);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void resample_rows_avx512(const uint32_t* const* rows, const uint32_t* weights, int taps,
+                                 unsigned char* out, int j0, int j1) {
+    const __m512i round = _mm512_set1_epi32(1 << (RESAMPLE_OUT_SHIFT - 1));
+    int x = j0;
+    for (; x + 16 <= j1; x += 16) {
+        __m512i acc = round;
+        for (int t = 0; t < taps; t++) {
+            __m512i v = _mm512_loadu_si512((const void*)(rows[t] + x));
+            acc = _mm512_add_epi32(acc, _mm512_mullo_epi32(v, _mm512_set1_epi32((int)weights[t])));
+        }
+        acc = _mm512_srli_epi32(acc, RESAMPLE_OUT_SHIFT);
+        _mm_storeu_si128((__m128i*)(out + x), _mm512_cvtepi32_epi8(acc));
+    }
+    resample_rows_avx2(rows, weights, taps, out, x, j1);
+}
+
+// the convolution passes are plain C compiled once more for the wider targets
+DEFINE_CONV_KERNEL_SET(conv_kernels_avx2, _avx2, __attribute__((target("avx2"))))
+DEFINE_CONV_KERNEL_SET(conv_kernels_avx512, _avx512, __attribute__((target("avx512f,avx512bw"))))
+
+#endif
+
+// picks the widest kernels the CPU supports (cpuid through __builtin_cpu_supports)
+// PGM_SIMD=scalar|sse2|avx2|avx512 caps the level, for testing and benchmarks
+void select_stencil_kernels(void) {
+    const char* cap = getenv("PGM_SIMD");
+    if (cap != NULL && strcmp(cap, "scalar") == 0) return;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    int allow_avx2 = cap == NULL || strcmp(cap, "avx2") == 0 || strcmp(cap, "avx512") == 0;
+    int allow_avx512 = cap == NULL || strcmp(cap, "avx512") == 0;
+    if (allow_avx512 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        StencilKernels k = { "avx512", average_row_avx512, sobel_row_avx512, prewitt_row_avx512, lbp_row_avx512,
+                             median_row_avx512, resample_rows_avx512, &conv_kernels_avx512 };
+        stencil_kernels = k;
+    } else if (allow_avx2 && __builtin_cpu_supports("avx2")) {
+        StencilKernels k = { "avx2", average_row_avx2, sobel_row_avx2, prewitt_row_avx2, lbp_row_avx2,
+                             median_row_avx2, resample_rows_avx2, &conv_kernels_avx2 };
+        stencil_kernels = k;
+    } else if (__builtin_cpu_supports("sse2")) {
+        StencilKernels k = { "sse2", average_row_sse2, sobel_row_sse2, prewitt_row_sse2, lbp_row_sse2,
+                             median_row_sse2, resample_rows_scalar, &conv_kernels_scalar };
+        stencil_kernels = k;
+    }
+#endif
+}
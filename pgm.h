@@ -0,0 +1,334 @@
+// PGM image processing library
+// Loading, saving and the operators of the processor, without any console I/O.
+// Every function that can fail returns a PgmStatus; nothing is printed and the
+// process is never exited. Operators run on the library's worker pool.
+//
+// Operators read src and write dst. When dst is empty (zero initialized) the
+// library allocates it; when it already holds pixels, e.g. a caller buffer set up
+// with pgm_image_wrap(), it must have the result size and is written in place.
+// dst must not share pixels with src. Images are released with pgm_image_free().
+
+#ifndef PGM_H
+#define PGM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the shared library is built with hidden visibility, only these functions are exported
+#if defined(__GNUC__)
+#define PGM_API __attribute__((visibility("default")))
+#else
+#define PGM_API
+#endif
+
+typedef enum {
+    PGM_OK = 0,
+    PGM_ERR_IO,          // the file could not be opened, read or written (see errno)
+    PGM_ERR_FORMAT,      // not a P5 (binary) or P2 (ascii) PGM
+    PGM_ERR_DIMENSIONS,  // invalid width or height
+    PGM_ERR_MAXVAL,      // invalid max_val
+    PGM_ERR_TRUNCATED,   // the header or pixel data ends early
+    PGM_ERR_NOMEM,       // out of memory
+    PGM_ERR_ARGUMENT,    // invalid parameter, empty image or dst of the wrong size
+    PGM_END              // pgm_read(): the stream ended cleanly before another frame
+} PgmStatus;
+
+// How the operators with a window (mean, median, convolution, Sobel, Prewitt, Canny,
+// LBP, morphology) treat pixels whose window leaves the image. With NONE the pixels the
+// window does not fit keep their value (filters) or are 0 (edge operators), morphology
+// cuts the window at the edge. The other modes extend the image into its guard band
+// first, so every pixel gets a full window. The mode belongs to the source image, see
+// pgm_image_set_border().
+typedef enum {
+    PGM_BORDER_NONE,       // default
+    PGM_BORDER_REPLICATE,  // aaa|abcd|ddd
+    PGM_BORDER_REFLECT,    // dcb|abcd|cba, mirrored about the edge pixel
+    PGM_BORDER_CONSTANT,   // vvv|abcd|vvv
+    PGM_BORDER_WRAP        // bcd|abcd|abc
+} PgmBorderMode;
+
+// All pixels live in one aligned buffer, row i starts at data + i * stride.
+// pixels[] is a row pointer view into that buffer. Operator results of an image with a
+// border mode carry a guard band of pad pixels on every side (rows -pad..-1
+// and height..height+pad-1, the same columns of every row); it is scratch space the
+// operators fill from the image, not part of it.
+typedef struct {
+    int width;
+    int height;
+    int max_val;
+    int stride;              // bytes between the start of two rows (>= width)
+    int pad;                 // guard band width around the image, 0 for none
+    unsigned char* data;     // first pixel of row 0
+    unsigned char** pixels;  // row pointer view into data
+    void* block;             // allocation holding the row pointers (and the pixels when owned)
+    void* map_base;          // non NULL when data is a read-only view into a mapped P5 file
+    size_t map_len;
+    int format;              // 2 or 5 for images read as P2 / P5, 0 otherwise
+    PgmBorderMode border;    // how the window operators extend this image, results inherit it
+    int border_value;        // pixel of PGM_BORDER_CONSTANT
+} PGMImage;
+
+// address of the first pixel in row i
+#define IMG_ROW(img, i) ((img)->data + (size_t)(i) * (img)->stride)
+
+typedef enum {
+    RESAMPLE_NEAREST,
+    RESAMPLE_BILINEAR,
+    RESAMPLE_AREA       // box average over the covered source area
+} ResampleMode;
+
+// LBP code mappings
+typedef enum {
+    LBP_MAP_RAW,      // 256 codes as computed
+    LBP_MAP_UNIFORM,  // 58 uniform patterns + 1 bin for all others
+    LBP_MAP_ROTINV    // 36 rotation-invariant classes
+} LbpMapping;
+
+// largest supported filter radius (window 255x255)
+#define PGM_MAX_FILTER_RADIUS 127
+
+// largest width or height a resize may produce
+#define PGM_MAX_IMAGE_DIM (1 << 20)
+
+// upper bound for worker threads
+#define PGM_MAX_THREADS 64
+
+// Images
+// zeroed width x height image (max_val 255) with cache line aligned rows
+PGM_API PgmStatus pgm_image_alloc(PGMImage* img, int width, int height);
+// view of a caller buffer, the library never frees or reallocates data
+PGM_API PgmStatus pgm_image_wrap(PGMImage* img, unsigned char* data, int width, int height, int stride);
+PGM_API PgmStatus pgm_image_copy(const PGMImage* src, PGMImage* dst);
+// mapped images are read-only until this copies them into an owned buffer
+PGM_API PgmStatus pgm_image_make_writable(PGMImage* img);
+PGM_API void pgm_image_free(PGMImage* img);
+// border mode the operators use on img and pass on to their results, value is the
+// CONSTANT pixel (0..255); an operator fills the guard band of a source that has one
+// wide enough in place, other sources are copied into a padded buffer
+PGM_API PgmStatus pgm_image_set_border(PGMImage* img, PgmBorderMode mode, int value);
+
+// Files and memory
+// P5 files are memory mapped and used in place, P2 files are decoded; img must be empty
+PGM_API PgmStatus pgm_load(const char* path, PGMImage* img);
+// parses a P5 or P2 image held in memory, the pixels are copied
+PGM_API PgmStatus pgm_decode(const void* data, size_t len, PGMImage* img);
+PGM_API PgmStatus pgm_save(const PGMImage* img, const char* path);
+// Streams of frames (images back to back, e.g. a camera pipe). pgm_read() takes the
+// next P5 frame from fp into the empty img and leaves fp at the byte after it;
+// pgm_write() appends img as a P5 frame (the caller flushes).
+PGM_API PgmStatus pgm_read(FILE* fp, PGMImage* img);
+PGM_API PgmStatus pgm_write(const PGMImage* img, FILE* fp);
+// header of a P5 or P2 image at the start of buf: format (2 or 5), size, max_val and
+// the offset of the first raster byte; a buffer that ends inside the header fails with
+// PGM_ERR_TRUNCATED
+PGM_API PgmStatus pgm_parse_header(const void* buf, size_t len, int* format, int* width, int* height,
+                                   int* max_val, size_t* offset);
+// P5 encoding into a caller buffer, *len gets the bytes written;
+// pgm_encoded_size() is the buffer size needed
+PGM_API size_t pgm_encoded_size(const PGMImage* img);
+PGM_API PgmStatus pgm_encode(const PGMImage* img, void* buf, size_t cap, size_t* len);
+
+// Operators
+// (2r+1)x(2r+1) mean and median, r = 1..PGM_MAX_FILTER_RADIUS; without a border mode
+// pixels closer than r to the border keep their value
+PGM_API PgmStatus pgm_mean_filter(const PGMImage* src, PGMImage* dst, int radius);
+PGM_API PgmStatus pgm_median_filter(const PGMImage* src, PGMImage* dst, int radius);
+PGM_API PgmStatus pgm_sobel(const PGMImage* src, PGMImage* dst);
+PGM_API PgmStatus pgm_prewitt(const PGMImage* src, PGMImage* dst);
+// Hysteresis thresholds, taken from the histogram of the suppressed image (pgm_canny
+// builds it during suppression, no extra pass). Strong pixels are >= high, weak >= low.
+typedef enum {
+    PGM_CANNY_RATIO,       // high and low are fractions of the strongest response (0.18, 0.09)
+    PGM_CANNY_OTSU,        // high is the Otsu level of the non-zero responses, low a fraction of it
+    PGM_CANNY_PERCENTILE,  // high is the high-th percentile (0..100) of the non-zero responses,
+                           // low a fraction of it
+    PGM_CANNY_FIXED        // low and high as given, 0..255
+} PgmCannyThresholdMode;
+
+typedef struct {
+    PgmCannyThresholdMode mode;
+    double low, high;  // high is ignored by PGM_CANNY_OTSU
+} PgmCannyThresholds;
+
+// full Canny; fixed_point selects the integer-only variant, thresholds NULL means
+// PGM_CANNY_RATIO 0.09 / 0.18
+PGM_API PgmStatus pgm_canny(const PGMImage* src, PGMImage* dst, int fixed_point,
+                            const PgmCannyThresholds* thresholds);
+// the two halves of pgm_canny: blur, gradient and non-maximum suppression fused,
+// then hysteresis thresholding in place (with a border mode pgm_canny also tracks
+// edges along the image edge, which the two calls leave to strong pixels)
+PGM_API PgmStatus pgm_canny_suppress(const PGMImage* src, PGMImage* dst, int fixed_point);
+PGM_API PgmStatus pgm_hysteresis(PGMImage* img, const PgmCannyThresholds* thresholds);
+PGM_API PgmStatus pgm_lbp(const PGMImage* src, PGMImage* dst, LbpMapping mapping);
+// number of histogram bins of a mapping (256, 59 or 36)
+PGM_API int pgm_lbp_bin_count(LbpMapping mapping);
+// per-cell histograms of the mapped codes into hist, which holds
+// cells_y * cells_x * pgm_lbp_bin_count(mapping) counts (cell row major, bins contiguous);
+// the one pixel frame is not counted, whatever the border mode
+PGM_API PgmStatus pgm_lbp_histograms(const PGMImage* src, LbpMapping mapping, int cells_x, int cells_y,
+                                     uint32_t* hist);
+// writes histograms from pgm_lbp_histograms() as an LBPF feature file
+PGM_API PgmStatus pgm_save_lbp_features(const char* path, const PGMImage* src, LbpMapping mapping,
+                                        int cells_x, int cells_y, const uint32_t* hist);
+PGM_API PgmStatus pgm_resize(const PGMImage* src, PGMImage* dst, int width, int height, ResampleMode mode);
+
+// Histogram statistics: one pass over the pixels fills the histogram, min, max, mean
+// and variance follow from its 256 bins
+typedef struct {
+    uint64_t hist[256];
+    uint64_t count;     // width * height
+    int min, max;
+    double mean;
+    double variance;    // population variance
+} PgmStats;
+
+PGM_API PgmStatus pgm_image_stats(const PGMImage* img, PgmStats* stats);
+// smallest value with at least percent (0..100) of the pixels at or below it
+PGM_API int pgm_stats_percentile(const PgmStats* stats, double percent);
+// Otsu threshold: splitting into <= t and > t maximizes the between-class variance
+PGM_API int pgm_stats_otsu(const PgmStats* stats);
+
+// Point operations through a 256 entry lookup table. The builders map into 0..max_val
+// (the image's max_val keeps the result a valid PGM).
+PGM_API PgmStatus pgm_apply_lut(const PGMImage* src, PGMImage* dst, const unsigned char lut[256]);
+// linear stretch of the low_pct..high_pct percentiles to 0..max_val (0, 100: min..max)
+PGM_API PgmStatus pgm_lut_stretch(const PgmStats* stats, double low_pct, double high_pct, int max_val,
+                                  unsigned char lut[256]);
+// histogram equalization: the cumulative distribution becomes linear
+PGM_API PgmStatus pgm_lut_equalize(const PgmStats* stats, int max_val, unsigned char lut[256]);
+// max_val * (v / max_val)^gamma, gamma < 1 brightens
+PGM_API PgmStatus pgm_lut_gamma(double gamma, int max_val, unsigned char lut[256]);
+
+// Convolution with a user kernel. The weighted sum of the window is divided by divisor,
+// offset by bias, rounded (down with round_down, else to nearest) and clamped to 0..255.
+// Kernels with integer weights are summed exactly in integers, others in float;
+// separable kernels run as two 1-D passes and symmetric rows fold mirrored taps.
+#define PGM_MAX_KERNEL_SIZE 31
+
+typedef struct {
+    int width;       // odd, 1..PGM_MAX_KERNEL_SIZE
+    int height;
+    float divisor;   // non-zero
+    float bias;
+    int round_down;  // 1: floor(sum / divisor) like the mean filter, 0: round to nearest
+    float weights[PGM_MAX_KERNEL_SIZE * PGM_MAX_KERNEL_SIZE];  // row major, width per row
+} PgmKernel;
+
+// width x height kernel from weights, divisor = sum of the weights (1 when that is 0)
+PGM_API PgmStatus pgm_kernel_init(PgmKernel* kernel, int width, int height, const float* weights);
+// Kernel text: numbers separated by commas or blanks, rows by ';' or new lines,
+// '#' starts a comment; "/ D" or "divisor D" sets the divisor, "bias B" the bias.
+// "1,2,1;2,4,2;1,2,1" is a 3x3 blur divided by 16.
+PGM_API PgmStatus pgm_kernel_parse(const char* text, PgmKernel* kernel);
+PGM_API PgmStatus pgm_kernel_load(const char* path, PgmKernel* kernel);
+// without a border mode pixels closer than the kernel radius to the border keep their value
+PGM_API PgmStatus pgm_convolve(const PGMImage* src, PGMImage* dst, const PgmKernel* kernel);
+// |kx response| + |ky response| clamped to 255 (Sobel, Prewitt), zero in the border
+// frame without a border mode
+PGM_API PgmStatus pgm_convolve_gradient(const PGMImage* src, PGMImage* dst, const PgmKernel* kx,
+                                        const PgmKernel* ky);
+
+// Morphology with a width x height rectangle (1..PGM_MAX_MORPH_SIZE each): erosion is
+// the window minimum, dilation the maximum, in three comparisons per pixel and pass
+// whatever the size. The window of (x, y) spans columns x - width / 2 .. x + (width - 1) / 2
+// and rows the same way; without a border mode it is cut at the image edge. Images with
+// only two values (Canny output, thresholds) run on packed bits.
+#define PGM_MAX_MORPH_SIZE 1023
+
+typedef enum {
+    PGM_MORPH_ERODE,
+    PGM_MORPH_DILATE,
+    PGM_MORPH_OPEN,     // erosion, then dilation
+    PGM_MORPH_CLOSE,    // dilation, then erosion
+    PGM_MORPH_GRADIENT  // dilation minus erosion
+} PgmMorphOp;
+
+PGM_API PgmStatus pgm_morphology(const PGMImage* src, PGMImage* dst, PgmMorphOp op, int width, int height);
+
+// Connected components of the non-zero pixels (edge maps, thresholds) with 4- or
+// 8-connectivity, labelled in parallel row bands joined at the seams. Labels count up
+// from 1 in raster order of each component's first pixel, 0 is the background; the
+// table is filled in the same pass. Border modes do not apply.
+typedef struct {
+    uint64_t area;       // pixels
+    int x0, y0, x1, y1;  // bounding box, inclusive
+    double cx, cy;       // centroid
+} PgmComponent;
+
+typedef struct {
+    int width, height;
+    uint32_t* labels;          // width * height labels, row major
+    uint32_t count;
+    PgmComponent* components;  // components[k - 1] describes label k
+} PgmLabels;
+
+// out is overwritten (release it with pgm_labels_free())
+PGM_API PgmStatus pgm_label_components(const PGMImage* src, int connectivity, PgmLabels* out);
+PGM_API void pgm_labels_free(PgmLabels* labels);
+// the table as CSV: label,area,x0,y0,x1,y1,cx,cy
+PGM_API PgmStatus pgm_save_components(const PgmLabels* labels, const char* path);
+
+// Gaussian pyramid: level 0 is a copy of the source, every further level is the level
+// above blurred with the 5x5 binomial kernel and decimated by two in one fused pass
+// (ceil sizes, so pixel (x, y) of level 0 lies in (x >> k, y >> k) of level k).
+// The levels stay in memory and any operator can run on them.
+#define PGM_MAX_PYRAMID_LEVELS 16
+
+typedef struct {
+    int levels;
+    PGMImage level[PGM_MAX_PYRAMID_LEVELS];
+} PgmPyramid;
+
+// operators pgm_pyramid_apply() can run per level
+typedef enum {
+    PGM_LEVEL_SOBEL,
+    PGM_LEVEL_PREWITT,
+    PGM_LEVEL_CANNY,
+    PGM_LEVEL_CANNY_FIXED,
+    PGM_LEVEL_LBP
+} PgmLevelOp;
+
+// builds up to `levels` levels (1..PGM_MAX_PYRAMID_LEVELS), fewer once a level is 1x1
+PGM_API PgmStatus pgm_pyramid_build(const PGMImage* src, int levels, PgmPyramid* pyr);
+// one blur and decimation step, dst is ceil(w / 2) x ceil(h / 2)
+PGM_API PgmStatus pgm_pyramid_reduce(const PGMImage* src, PGMImage* dst);
+// runs op on level `level`, or on every level when level < 0; maps gets the results at
+// the same indices (other levels stay empty) and is released with pgm_pyramid_free();
+// thresholds are those of pgm_canny()
+PGM_API PgmStatus pgm_pyramid_apply(const PgmPyramid* pyr, PgmLevelOp op, int level, PgmPyramid* maps,
+                                    const PgmCannyThresholds* thresholds);
+// multi-scale map: per pixel maximum over the levels of maps, at the size of level 0
+PGM_API PgmStatus pgm_pyramid_combine(const PgmPyramid* maps, PGMImage* dst);
+PGM_API void pgm_pyramid_free(PgmPyramid* pyr);
+
+// Runtime
+// worker threads (1..PGM_MAX_THREADS), takes effect before the first parallel operation;
+// default PGM_THREADS, else one per CPU
+PGM_API void pgm_set_threads(int n);
+PGM_API int pgm_thread_count(void);
+// SIMD level in use: "scalar", "sse2", "avx2" or "avx512" (PGM_SIMD caps it)
+PGM_API const char* pgm_simd_level(void);
+// returns the pooled image and scratch buffers to the heap
+PGM_API void pgm_release_buffers(void);
+PGM_API const char* pgm_status_string(PgmStatus status);
+
+// Stage profiling: wall and CPU time, peak heap bytes and allocations per stage.
+// Stages nest and are opened and closed on one thread; the library adds its own
+// sub-stages (the Canny stages) while profiling is enabled.
+PGM_API void pgm_profile_enable(void);
+PGM_API void pgm_profile_begin(const char* name);
+PGM_API void pgm_profile_end(void);
+PGM_API void pgm_profile_report(FILE* out);
+// Chrome trace-event JSON, opens in chrome://tracing or Perfetto
+PGM_API PgmStatus pgm_profile_write_trace(const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif